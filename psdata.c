@@ -33,6 +33,20 @@
 #define PSDATA_WIN
 #endif
 
+/*
+ * On POSIX platforms, request 64-bit file offsets and the extended
+ * lseek() whence values SEEK_DATA and SEEK_HOLE.  These must be defined
+ * before any system header is included.
+ */
+#ifndef PSDATA_WIN
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
 /*
  * Include core headers.
  */
@@ -49,6 +63,133 @@
 #include <io.h>
 #endif
 
+/*
+ * POSIX-only additional headers.
+ */
+#ifndef PSDATA_WIN
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Detect whether sparse input files can be scanned for holes.
+ * 
+ * This requires the SEEK_DATA and SEEK_HOLE extensions to lseek(),
+ * which are available on Linux, Solaris, the BSDs, and macOS.  You can
+ * force sparse file support off by defining PSDATA_NOSPARSE during
+ * compilation.
+ */
+#ifndef PSDATA_WIN
+#ifndef PSDATA_NOSPARSE
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+#define PSDATA_SPARSE
+#endif
+#endif
+#endif
+
+/*
+ * Detect whether hardware CRC32C instructions can be used.
+ * 
+ * If the compiler has been told that the target supports them, for
+ * example with -msse4.2 or -march=native on GCC, they are always used.
+ * Otherwise, when compiling for x86-64 with GCC or Clang, the SSE4.2
+ * instructions are compiled into a separate function, which is used if
+ * the processor supports them at runtime.  In all other cases, and on
+ * processors without SSE4.2, a portable table-driven implementation is
+ * used.  You can force the portable implementation by defining
+ * PSDATA_NOHWCRC during compilation.
+ */
+#ifndef PSDATA_NOHWCRC
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define PSDATA_CRC_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define PSDATA_CRC_ARM
+#elif defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define PSDATA_CRC_SSE42
+#define PSDATA_CRC_DISPATCH
+#endif
+#endif
+
+/*
+ * Detect whether vector instructions can be used to convert bytes to
+ * base-16 digits for the -hex option.
+ * 
+ * SSSE3 is used on x86 if the compiler has been told that the target
+ * supports it, for example with -mssse3 or -march=native on GCC.
+ * Otherwise, SSE2 is used on x86 if available, which is always the case
+ * on x86-64.  NEON is used on 64-bit ARM.  On other targets, a portable
+ * table-driven implementation is used.  You can force the portable
+ * implementation by defining PSDATA_NOSIMD during compilation.
+ */
+#ifndef PSDATA_NOSIMD
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define PSDATA_HEX_SSSE3
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PSDATA_HEX_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PSDATA_HEX_NEON
+#endif
+#endif
+
+/*
+ * Detect whether static tracepoints can be compiled in.
+ * 
+ * On POSIX platforms where the SystemTap <sys/sdt.h> header is
+ * available, USDT probes are placed at the input and output buffer
+ * boundaries so that tools such as bpftrace and perf can trace them.
+ * Each probe has a semaphore, so that the probe arguments are only
+ * computed while a tracer is attached.  You can force the probes off by
+ * defining PSDATA_NOUSDT during compilation, or force them on with a
+ * compiler that lacks __has_include by defining PSDATA_USDT.
+ */
+#ifndef PSDATA_WIN
+#ifndef PSDATA_NOUSDT
+#ifndef PSDATA_USDT
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#define PSDATA_USDT
+#endif
+#endif
+#endif
+#endif
+#endif
+
+#ifdef PSDATA_WIN
+#undef PSDATA_USDT
+#endif
+
+#ifdef PSDATA_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#include <time.h>
+#endif
+
+/*
+ * Fire the USDT probe psdata:name with a byte count and a CLOCK_MONOTONIC
+ * timestamp in nanoseconds as arguments.
+ * 
+ * The arguments are only evaluated if a tracer has enabled the probe,
+ * and the whole probe is compiled out if PSDATA_USDT is not defined.
+ */
+#ifdef PSDATA_USDT
+#define PSDATA_PROBE(name, bytes) \
+  do { \
+    if (psdata_##name##_semaphore) { \
+      DTRACE_PROBE2(psdata, name, (int64_t) (bytes), probe_time()); \
+    } \
+  } while (0)
+#else
+#define PSDATA_PROBE(name, bytes) do { } while (0)
+#endif
+
 /*
  * Constants
  * =========
@@ -86,6 +227,100 @@
  */
 #define ENCODE_BUF (4096)
 
+/*
+ * The maximum number of characters in a name given to the -reuse or
+ * -filter options.
+ */
+#define MAX_NAME (127)
+
+/*
+ * The number of characters to allow for the text that wraps the data
+ * as a reusable stream, which is enough for two names of MAX_NAME
+ * characters, the header line, and the fixed operators.
+ */
+#define MAX_REUSE (1024)
+
+/*
+ * The default prefix of the names generated for the -dedup option, and
+ * the maximum length of a prefix, which leaves room for a 64-bit
+ * decimal serial number within MAX_NAME.
+ */
+#define DEFAULT_PREFIX "psdata"
+#define MAX_PREFIX (MAX_NAME - 20)
+
+/*
+ * The maximum number of characters in a line of the deduplication state
+ * file, including the line break.
+ */
+#define MAX_STATE_LINE (2 * SHA256_DIGEST + MAX_NAME + 8)
+
+/*
+ * The default number of input bytes between entries in the offset
+ * index written with the -index option.
+ */
+#define DEFAULT_STEP (65536)
+
+/*
+ * The number of bytes in the header of an offset index file, and in
+ * each of its entries.
+ */
+#define INDEX_HEAD (40)
+#define INDEX_ENTRY (16)
+
+/*
+ * The number of index entries to adjust at a time when adding the
+ * DSC header offset to an index file.
+ */
+#define INDEX_BATCH (256)
+
+/*
+ * The format version written to offset index files.
+ */
+#define INDEX_VERSION (1)
+
+/*
+ * The ways that segments of output can be wrapped.
+ * 
+ * SEG_PLAIN is used when DSC mode is off, and segments are written
+ * directly to standard output without any wrapping.
+ * 
+ * SEG_SPOOL is used in DSC mode when the line counts are not known in
+ * advance.  Segments are written to a temporary file, and wrapped in
+ * %%BeginData and %%EndData tags when they are transferred to standard
+ * output at the end.
+ * 
+ * SEG_STREAM is used in DSC mode when the line counts are predicted in
+ * advance.  Segments are written directly to standard output, and the
+ * tags are written around them as they are generated.
+ */
+#define SEG_PLAIN  (0)
+#define SEG_SPOOL  (1)
+#define SEG_STREAM (2)
+
+/*
+ * Checksum algorithms that can be selected with the -sum option.
+ */
+#define SUM_NONE   (0)
+#define SUM_CRC32C (1)
+#define SUM_SHA256 (2)
+
+/*
+ * The text that begins the checksum comment, before the algorithm name
+ * and the base-16 checksum.
+ */
+#define SUM_PREFIX "psdata-sum "
+
+/*
+ * The reflected CRC32C (Castagnoli) polynomial.
+ */
+#define CRC32C_POLY (0x82f63b78UL)
+
+/*
+ * The number of bytes in a SHA-256 block and digest.
+ */
+#define SHA256_BLOCK (64)
+#define SHA256_DIGEST (32)
+
 /*
  * Local data
  * ==========
@@ -127,7 +362,230 @@ static FILE *m_out = NULL;
 /*
  * The number of raw bytes written by buf_char().
  */
-static int32_t m_data_count = 0;
+static int64_t m_data_count = 0;
+
+/*
+ * The output buffer used by buf_char() and buf_run().
+ * 
+ * m_buf_count is the number of characters currently in the buffer.
+ */
+static char m_buf[WRITE_BUF];
+static int32_t m_buf_count = 0;
+
+/*
+ * The Base-85 accumulator used while encoding input.
+ * 
+ * m_acc holds the input bytes that have been accumulated so far, with
+ * the most recent byte in the least significant position.
+ * 
+ * m_acc_count is the number of bytes in the accumulator, in range
+ * [0, 3] between calls to the encoding functions.
+ */
+static uint32_t m_acc = 0;
+static int m_acc_count = 0;
+
+/*
+ * The checksum computed over input while encoding.
+ * 
+ * m_sum_type is one of the SUM_ constants.  If it is SUM_NONE, no
+ * checksum is computed.
+ * 
+ * m_crc is the CRC32C register, without the final inversion applied.
+ * 
+ * m_sha_state, m_sha_block, m_sha_fill, and m_sha_len are the SHA-256
+ * chaining state, the partial block, the number of bytes in the
+ * partial block, and the total number of bytes hashed.
+ */
+static int m_sum_type = SUM_NONE;
+static uint32_t m_crc = 0xffffffffUL;
+static uint32_t m_sha_state[8];
+static uint8_t m_sha_block[SHA256_BLOCK];
+static int32_t m_sha_fill = 0;
+static uint64_t m_sha_len = 0;
+
+/*
+ * The number of input bytes that have been given to the encoder.
+ */
+static int64_t m_in_count = 0;
+
+/*
+ * Flag that is set when the "z" code for zero dwords is disabled.
+ * 
+ * When this is set, every dword is encoded with five digits, so the
+ * length of the output only depends on the length of the input.
+ */
+static int m_noz = 0;
+
+/*
+ * Flag that is set when output is encoded in base-16 for the
+ * ASCIIHexDecode filter instead of Base-85.
+ * 
+ * When this is set, every input byte is encoded as two base-16 digits
+ * and the end of stream marker is ">", so the length of the output only
+ * depends on the length of the input.
+ */
+static int m_hex = 0;
+
+/*
+ * The base-16 digits used for the -hex option.
+ */
+static const char *m_hex_digits = "0123456789ABCDEF";
+
+/*
+ * Structure recording one segment of output.
+ * 
+ * The whole output is a single segment unless the -chunk option is
+ * used, in which case each segment is a complete data stream that ends
+ * with its own end of stream marker.
+ * 
+ * start_off and start_line are the values of m_data_count and
+ * m_line_count at the start of the segment, and bytes and lines are
+ * the number written in the segment once it is complete.
+ * 
+ * shift_off and shift_line are the number of bytes and lines written
+ * to output outside of buf_char() before the data of this segment,
+ * which are the %%BeginData and %%EndData tag lines in SEG_SPOOL mode.
+ * They are needed to convert offsets in the data into offsets in the
+ * output.
+ * 
+ * pred is the predicted number of lines in the segment, which is only
+ * used in SEG_STREAM mode.
+ */
+typedef struct {
+  int64_t start_off;
+  int64_t bytes;
+  int32_t start_line;
+  int32_t lines;
+  int64_t shift_off;
+  int32_t shift_line;
+  int64_t pred;
+} SEGMENT;
+
+/*
+ * The segment state.
+ * 
+ * m_seg_cur is the current segment, and m_seg_count is the number of
+ * segments that have been opened.
+ * 
+ * m_seg is a dynamically allocated array with room for m_seg_cap
+ * segments, which records each segment as it is closed.  It is only
+ * used in SEG_SPOOL mode, where the line counts of all segments must be
+ * kept until the spooled output is transferred, so that the other modes
+ * run in constant memory however many segments there are.
+ * 
+ * m_seg_mode is one of the SEG_ constants.
+ * 
+ * m_seg_chunk is the number of input bytes in each segment, or zero if
+ * the output is not divided into segments.  It is a multiple of four.
+ * 
+ * m_seg_next is the input offset at which the next segment begins, or
+ * -1 if there are no more segment boundaries.
+ * 
+ * m_seg_pre is the text written at the start of each segment, or NULL
+ * if there is none, and m_seg_pre_lines is the number of lines in it.
+ * 
+ * m_seg_post_lines is the number of lines written after the end of
+ * stream marker of the last segment, not including the checksum.
+ * 
+ * m_seg_len is the expected total input length, which is only used in
+ * SEG_STREAM mode to predict the line counts.
+ * 
+ * m_seg_extra_off and m_seg_extra_line are the number of bytes and
+ * lines that have been written to output outside of buf_char() so far.
+ */
+static SEGMENT m_seg_cur;
+static SEGMENT *m_seg = NULL;
+static int64_t m_seg_cap = 0;
+static int64_t m_seg_count = 0;
+static int m_seg_mode = SEG_PLAIN;
+static int64_t m_seg_chunk = 0;
+static int64_t m_seg_next = -1;
+static const char *m_seg_pre = NULL;
+static int32_t m_seg_pre_lines = 0;
+static int32_t m_seg_post_lines = 0;
+static int64_t m_seg_len = 0;
+static int64_t m_seg_extra_off = 0;
+static int32_t m_seg_extra_line = 0;
+
+/*
+ * The offset index being written.
+ * 
+ * m_index is the index file, or NULL if no index is being written.
+ * 
+ * m_index_step is the number of input bytes between index entries.  It
+ * is always a multiple of four, so that each entry falls on a dword
+ * boundary.
+ * 
+ * m_index_next is the input offset at which the next index entry will
+ * be recorded, or -1 if no more entries will be recorded.
+ * 
+ * m_index_count is the number of entries that have been recorded.
+ */
+static FILE *m_index = NULL;
+static int32_t m_index_step = DEFAULT_STEP;
+static int64_t m_index_next = -1;
+static int64_t m_index_count = 0;
+
+/*
+ * The SHA-256 round constants.
+ */
+static const uint32_t m_sha_k[64] = {
+  0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+  0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+  0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+  0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+  0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+  0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+  0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+  0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+  0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+  0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+  0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+  0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+  0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+  0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+  0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+  0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+/*
+ * The USDT probe semaphores.
+ * 
+ * A tracer increments the semaphore of a probe while the probe is
+ * enabled.  These must have external linkage and be placed in the
+ * .probes section, because the probe notes refer to them by name.
+ * 
+ * psdata:read fires after each block of input is read, and psdata:hole
+ * before each hole of sparse input is encoded without reading it.
+ * 
+ * psdata:flush fires before each flush of the output buffer, which goes
+ * to the temporary file while the DSC output is being spooled.
+ * 
+ * psdata:spool_start fires when DSC output starts being spooled to the
+ * temporary file, with the input length if known or else -1, and
+ * psdata:spool_end fires when all the output has been spooled, with the
+ * number of bytes in the temporary file.
+ * 
+ * psdata:transfer fires after each block of spooled output is copied
+ * from the temporary file to standard output.
+ * 
+ * The first argument of each probe is the byte count and the second is
+ * the timestamp.
+ */
+#ifdef PSDATA_USDT
+unsigned short psdata_read_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+unsigned short psdata_hole_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+unsigned short psdata_flush_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+unsigned short psdata_spool_start_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+unsigned short psdata_spool_end_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+unsigned short psdata_transfer_semaphore
+  __attribute__((unused)) __attribute__((section(".probes")));
+#endif
 
 /*
  * Local functions
@@ -135,15 +593,128 @@ static int32_t m_data_count = 0;
  */
 
 /* Prototypes */
+#ifdef PSDATA_USDT
+static int64_t probe_time(void);
+#endif
 static void buf_char(int c);
+#ifdef PSDATA_SPARSE
+static void buf_run(int c, int32_t n);
+#endif
+static void buf_copy(const char *pc, int32_t n);
 static void write_char(int c);
+#ifdef PSDATA_SPARSE
+static void write_run(int c, int64_t n);
+#endif
+static void write_block(const char *pc, int64_t n);
+static void write_eod(void);
 static void line_break(void);
 
 static void encode_dword(uint32_t eax, int pad);
-static int encode_input(void);
+static void hex_block(const uint8_t *pb, int32_t len, char *pc);
+static void encode_hex(const uint8_t *pb, int32_t len);
+static void encode_bytes(const uint8_t *pb, int32_t len);
+static void encode_finish(void);
+#ifdef PSDATA_SPARSE
+static void encode_zeros(int64_t count);
+static int encode_sparse(FILE *pIn, int *pstatus);
+#endif
+static int encode_input(FILE *pIn);
+static int input_length(FILE *pIn, int64_t *plen);
+static void encode_point(void);
+static int64_t encode_run_limit(int64_t run, int unit);
+static int64_t encode_excess(int64_t len);
+
+#if defined(PSDATA_CRC_SSE42) || defined(PSDATA_CRC_ARM)
+static void crc_update_hw(const uint8_t *pb, int32_t len);
+#endif
+#if !defined(PSDATA_CRC_SSE42) || defined(PSDATA_CRC_DISPATCH)
+static void crc_update_table(const uint8_t *pb, int32_t len);
+#endif
+static void crc_update(const uint8_t *pb, int32_t len);
+#ifdef PSDATA_SPARSE
+static void crc_zeros(int64_t count);
+#endif
+static void sha_block(const uint8_t *pb);
+static void sha_update(const uint8_t *pb, int32_t len);
+static void sum_init(int sum_type);
+static void sum_update(const uint8_t *pb, int32_t len);
+#ifdef PSDATA_SPARSE
+static void sum_zeros(int64_t count);
+#endif
+static const char *sum_name(void);
+static void sum_hex(char *pstr);
+
+static void write_comment(const char *pstr);
+static void write_sum(int report);
+
+static int seek_file(FILE *pf, int64_t pos);
+static void put_le(uint8_t *pb, uint64_t v, int len);
+static uint64_t get_le(const uint8_t *pb, int len);
+static void index_mark(void);
+static int index_finish(void);
+static int extract_input(
+    const char *pPath,
+    int64_t offset,
+    int64_t len,
+    int64_t base);
+static int dedup_hash(FILE **ppIn, char *pHex);
+static int dedup_lookup(
+    const char *pPath,
+    const char *pHex,
+    const char *pPrefix,
+    char *pName,
+    int *pFound);
+static int dedup_record(
+    const char *pPath,
+    const char *pHex,
+    const char *pName);
+static int64_t predict_lines(int64_t inlen, int32_t pre, int32_t post);
+static int32_t sum_lines(void);
+static int32_t dsc_begin(int64_t lines);
+static int32_t dsc_end(void);
+static void seg_open(void);
+static void seg_close(void);
+static void seg_break(void);
+static int32_t wrap_tokens(const char *pSrc, char *pDst);
+static int reuse_lines(
+    const char *pName,
+    const char *pFilter,
+    const char *pHead,
+    char *pDef,
+    char *pEnd,
+    char *pUse,
+    int32_t *pDefLines,
+    int32_t *pEndLines,
+    int32_t *pUseLines);
+static void write_line(const char *pstr);
 
 static int check_head(const char *pstr);
+static int check_name(const char *pstr);
 static int parseInt(const char *pstr, int32_t *pv);
+static int parseLong(const char *pstr, int64_t *pv);
+
+#ifdef PSDATA_USDT
+/*
+ * Read the CLOCK_MONOTONIC clock for a USDT probe argument.
+ * 
+ * Return:
+ * 
+ *   the current time in nanoseconds, or zero if the clock can not be
+ *   read
+ */
+static int64_t probe_time(void) {
+  
+  struct timespec ts;
+  
+  memset(&ts, 0, sizeof(struct timespec));
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+    return 0;
+  }
+  
+  return (((int64_t) ts.tv_sec) * INT64_C(1000000000)) +
+    ((int64_t) ts.tv_nsec);
+}
+#endif
 
 /*
  * Buffered writing function for output characters.
@@ -166,17 +737,6 @@ static void buf_char(int c) {
   
   FILE *pOut = NULL;
   
-  static char s_buf[WRITE_BUF];
-  static int s_buf_init = 0;
-  static int32_t s_buf_count = 0;
-  
-  /* Initialize static buffer if necessary */
-  if (!s_buf_init) {
-    s_buf_init = 1;
-    s_buf_count = 0;
-    memset(s_buf, 0, WRITE_BUF);
-  }
-  
   /* Check parameter */
   if ((c < -1) || (c > 127)) {
     abort();
@@ -184,7 +744,7 @@ static void buf_char(int c) {
   
   /* If not special -1 signal, then increase byte counter */
   if (c != -1) {
-    if (m_data_count < INT32_MAX) {
+    if (m_data_count < INT64_MAX) {
       m_data_count++;
     } else {
       fprintf(stderr, "%s: Byte counter overflow!\n", pModule);
@@ -194,7 +754,7 @@ static void buf_char(int c) {
   
   /* Flush output buffer if full or if -1 was passed and there is data
    * in the buffer */
-  if ((s_buf_count >= WRITE_BUF) || ((c == -1) && (s_buf_count > 0))) {
+  if ((m_buf_count >= WRITE_BUF) || ((c == -1) && (m_buf_count > 0))) {
     
     /* Determine output file */
     if (m_out != NULL) {
@@ -204,20 +764,119 @@ static void buf_char(int c) {
     }
     
     /* Write buffered data to output */
-    if (fwrite(s_buf, 1, (size_t) s_buf_count, pOut) != s_buf_count) {
+    PSDATA_PROBE(flush, m_buf_count);
+    if (fwrite(m_buf, 1, (size_t) m_buf_count, pOut)
+          != (size_t) m_buf_count) {
       fprintf(stderr, "%s: I/O error writing to temporary file!\n",
         pModule);
       abort();
     }
     
     /* Reset buffer */
-    s_buf_count = 0;
+    m_buf_count = 0;
   }
   
   /* Add character to buffer unless -1 was passed */
   if (c >= 0) {
-    s_buf[s_buf_count] = (char) c;
-    s_buf_count++;
+    m_buf[m_buf_count] = (char) c;
+    m_buf_count++;
+  }
+}
+
+#ifdef PSDATA_SPARSE
+/*
+ * Buffered writing function for a run of identical output characters.
+ * 
+ * This has the same effect as calling buf_char() n times with the
+ * character c, except that the run is copied into the output buffer in
+ * blocks.
+ * 
+ * Parameters:
+ * 
+ *   c - the character to output, in range [0, 127]
+ * 
+ *   n - the number of times to output the character
+ */
+static void buf_run(int c, int32_t n) {
+  
+  int32_t blen = 0;
+  
+  /* Check parameters */
+  if ((c < 0) || (c > 127) || (n < 0)) {
+    abort();
+  }
+  
+  /* Increase byte counter */
+  if (m_data_count <= INT64_MAX - n) {
+    m_data_count += n;
+  } else {
+    fprintf(stderr, "%s: Byte counter overflow!\n", pModule);
+    abort();
+  }
+  
+  /* Copy the run into the buffer, flushing whenever it fills */
+  while (n > 0) {
+    if (m_buf_count >= WRITE_BUF) {
+      buf_char(-1);
+    }
+    
+    blen = WRITE_BUF - m_buf_count;
+    if (blen > n) {
+      blen = n;
+    }
+    
+    memset(&(m_buf[m_buf_count]), c, (size_t) blen);
+    m_buf_count += blen;
+    n -= blen;
+  }
+}
+#endif
+
+/*
+ * Buffered writing function for a block of output characters.
+ * 
+ * This has the same effect as calling buf_char() for each of the n
+ * characters in pc, except that the characters are copied into the
+ * output buffer in blocks.
+ * 
+ * Parameters:
+ * 
+ *   pc - the characters to output, each in range [0, 127]
+ * 
+ *   n - the number of characters to output
+ */
+static void buf_copy(const char *pc, int32_t n) {
+  
+  int32_t blen = 0;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (n < 0)) {
+    abort();
+  }
+  
+  /* Increase byte counter */
+  if (m_data_count <= INT64_MAX - n) {
+    m_data_count += n;
+  } else {
+    fprintf(stderr, "%s: Byte counter overflow!\n", pModule);
+    abort();
+  }
+  
+  /* Copy the block into the buffer, flushing whenever it fills */
+  while (n > 0) {
+    if (m_buf_count >= WRITE_BUF) {
+      buf_char(-1);
+    }
+    
+    blen = WRITE_BUF - m_buf_count;
+    if (blen > n) {
+      blen = n;
+    }
+    
+    memcpy(&(m_buf[m_buf_count]), pc, (size_t) blen);
+    m_buf_count += blen;
+    pc += blen;
+    n -= blen;
   }
 }
 
@@ -300,31 +959,133 @@ static void write_char(int c) {
   }
 }
 
+#ifdef PSDATA_SPARSE
 /*
- * Write a line break to standard output.
+ * Write a run of identical characters to output.
  * 
- * CAUTION:  Do NOT use this function in places where you are using the
- * write_char() function, because this function outputs directly to
- * standard output ignoring any buffering and redirection.
+ * This has the same effect as calling write_char() n times with the
+ * character c, including the insertion of implicit line breaks, except
+ * that each line is written in a single block with buf_run().
+ * 
+ * Parameters:
+ * 
+ *   c - the character to output, in US-ASCII printing range
+ * 
+ *   n - the number of times to output the character
  */
-static void line_break(void) {
+static void write_run(int c, int64_t n) {
   
-  /* On Windows only, CR is required first */
-#ifdef PSDATA_WIN
-  if (putchar('\r') != '\r') {
-    fprintf(stderr, "%s: I/O error writing to standard output!\n",
-      pModule);
-    abort();
-  }
-#endif
+  int32_t llen = 0;
   
-  /* Write the LF character */
-  if (putchar('\n') != '\n') {
-    fprintf(stderr, "%s: I/O error writing to standard output!\n",
-      pModule);
+  /* Check parameters */
+  if ((c < 0x20) || (c > 0x7e) || (n < 0)) {
     abort();
   }
-}
+  
+  /* Write the run line by line */
+  while (n > 0) {
+    /* Insert an implicit line break if the current line is full */
+    if (m_line_pos >= m_line_len) {
+      write_char('\n');
+    }
+    
+    /* Fill as much of the current line as possible */
+    llen = m_line_len - m_line_pos;
+    if (llen > n) {
+      llen = (int32_t) n;
+    }
+    
+    buf_run(c, llen);
+    m_line_pos += llen;
+    n -= llen;
+  }
+}
+#endif
+
+/*
+ * Write a block of characters to output.
+ * 
+ * This has the same effect as calling write_char() for each of the n
+ * characters in pc, including the insertion of implicit line breaks,
+ * except that each line is written in a single block with buf_copy().
+ * The block may not contain line breaks.
+ * 
+ * Parameters:
+ * 
+ *   pc - the characters to output, each in US-ASCII printing range
+ * 
+ *   n - the number of characters to output
+ */
+static void write_block(const char *pc, int64_t n) {
+  
+  int32_t llen = 0;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (n < 0)) {
+    abort();
+  }
+  
+  /* Write the block line by line */
+  while (n > 0) {
+    /* Insert an implicit line break if the current line is full */
+    if (m_line_pos >= m_line_len) {
+      write_char('\n');
+    }
+    
+    /* Fill as much of the current line as possible */
+    llen = m_line_len - m_line_pos;
+    if (llen > n) {
+      llen = (int32_t) n;
+    }
+    
+    buf_copy(pc, llen);
+    m_line_pos += llen;
+    pc += llen;
+    n -= llen;
+  }
+}
+
+/*
+ * Write the end of stream marker to output with write_char().
+ * 
+ * The marker is "~>" for Base-85 and ">" for base-16.  It is written on
+ * a line by itself, so a line break is written both before and after
+ * it.
+ */
+static void write_eod(void) {
+  write_char('\n');
+  if (!m_hex) {
+    write_char('~');
+  }
+  write_char('>');
+  write_char('\n');
+}
+
+/*
+ * Write a line break to standard output.
+ * 
+ * CAUTION:  Do NOT use this function in places where you are using the
+ * write_char() function, because this function outputs directly to
+ * standard output ignoring any buffering and redirection.
+ */
+static void line_break(void) {
+  
+  /* On Windows only, CR is required first */
+#ifdef PSDATA_WIN
+  if (putchar('\r') != '\r') {
+    fprintf(stderr, "%s: I/O error writing to standard output!\n",
+      pModule);
+    abort();
+  }
+#endif
+  
+  /* Write the LF character */
+  if (putchar('\n') != '\n') {
+    fprintf(stderr, "%s: I/O error writing to standard output!\n",
+      pModule);
+    abort();
+  }
+}
 
 /*
  * Encode an unsigned 32-bit into Base-85 with possible padding.
@@ -358,8 +1119,8 @@ static void encode_dword(uint32_t eax, int pad) {
   }
   
   /* If there are no padding bytes AND the value is zero, then use the
-   * special "z" code */
-  if ((pad == 0) && (eax == 0)) {
+   * special "z" code, unless it has been disabled */
+  if ((pad == 0) && (eax == 0) && (!m_noz)) {
     write_char('z');
     return;
   }
@@ -381,104 +1142,2903 @@ static void encode_dword(uint32_t eax, int pad) {
 }
 
 /*
- * Read all binary data from standard input, encode it in Base-85, and
- * write the Base-85 characters to the write_char() function.
+ * Convert bytes to pairs of base-16 digits, most significant digit
+ * first.
  * 
- * See the write_char() function for further information about output.
+ * If vector instructions are available, sixteen bytes are converted at
+ * a time by splitting them into nibbles.  With SSSE3 and NEON, each
+ * nibble is used as an index into a vector holding the sixteen digits.
+ * SSE2 has no such lookup, so '0' is added to each nibble, plus the
+ * distance from '9' + 1 to 'A' for nibbles above nine.  Any remaining
+ * bytes are converted one at a time.
  * 
- * Return:
+ * pc must have room for at least (2 * len) characters.  No terminating
+ * nul is written.
  * 
- *   non-zero if successful, zero if error
+ * Parameters:
+ * 
+ *   pb - the bytes to convert
+ * 
+ *   len - the number of bytes to convert
+ * 
+ *   pc - receives the digits
  */
-static int encode_input(void) {
+static void hex_block(const uint8_t *pb, int32_t len, char *pc) {
   
-  static uint8_t buf[ENCODE_BUF];
+#if defined(PSDATA_HEX_SSSE3)
+  __m128i table;
+  __m128i mask;
+  __m128i x;
+  __m128i hi;
+  __m128i lo;
+#elif defined(PSDATA_HEX_SSE2)
+  __m128i mask;
+  __m128i zero;
+  __m128i nine;
+  __m128i gap;
+  __m128i x;
+  __m128i hi;
+  __m128i lo;
+#elif defined(PSDATA_HEX_NEON)
+  uint8x16_t table;
+  uint8x16_t x;
+  uint8x16x2_t z;
+#endif
   
-  int status = 1;
-  int32_t rcount = 0;
-  int32_t pcount = 0;
+  /* Check parameters */
+  if ((pb == NULL) || (len < 0) || (pc == NULL)) {
+    abort();
+  }
   
-  uint32_t eax = 0;
-  int cx = 0;
+#if defined(PSDATA_HEX_SSSE3)
+  /* Convert sixteen bytes at a time, interleaving the high and low
+   * nibble digits */
+  table = _mm_loadu_si128((const __m128i *) m_hex_digits);
+  mask = _mm_set1_epi8(0x0f);
+  for( ; len >= 16; len -= 16) {
+    x = _mm_loadu_si128((const __m128i *) pb);
+    hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+    lo = _mm_and_si128(x, mask);
+    hi = _mm_shuffle_epi8(table, hi);
+    lo = _mm_shuffle_epi8(table, lo);
+    _mm_storeu_si128((__m128i *) pc, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *) (pc + 16), _mm_unpackhi_epi8(hi, lo));
+    pb += 16;
+    pc += 32;
+  }
   
-  /* Clear the encoding buffer */
-  memset(buf, 0, ENCODE_BUF);
+#elif defined(PSDATA_HEX_SSE2)
+  /* Convert sixteen bytes at a time, computing the digits arithmetically
+   * and interleaving the high and low nibble digits */
+  mask = _mm_set1_epi8(0x0f);
+  zero = _mm_set1_epi8('0');
+  nine = _mm_set1_epi8(9);
+  gap = _mm_set1_epi8('A' - '9' - 1);
+  for( ; len >= 16; len -= 16) {
+    x = _mm_loadu_si128((const __m128i *) pb);
+    hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+    lo = _mm_and_si128(x, mask);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+          _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+          _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+    _mm_storeu_si128((__m128i *) pc, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *) (pc + 16), _mm_unpackhi_epi8(hi, lo));
+    pb += 16;
+    pc += 32;
+  }
   
-  /* Keep processing while we read data */
-  for(rcount = (int32_t) fread(buf, 1, ENCODE_BUF, stdin);
-      rcount > 0;
-      rcount = (int32_t) fread(buf, 1, ENCODE_BUF, stdin)) {
+#elif defined(PSDATA_HEX_NEON)
+  /* Convert sixteen bytes at a time, with an interleaving store of the
+   * high and low nibble digits */
+  table = vld1q_u8((const uint8_t *) m_hex_digits);
+  for( ; len >= 16; len -= 16) {
+    x = vld1q_u8(pb);
+    z.val[0] = vqtbl1q_u8(table, vshrq_n_u8(x, 4));
+    z.val[1] = vqtbl1q_u8(table, vandq_u8(x, vdupq_n_u8(0x0f)));
+    vst2q_u8((uint8_t *) pc, z);
+    pb += 16;
+    pc += 32;
+  }
+#endif
+  
+  /* Convert any remaining bytes */
+  for( ; len > 0; len--) {
+    pc[0] = m_hex_digits[(*pb) >> 4];
+    pc[1] = m_hex_digits[(*pb) & 0x0f];
+    pb++;
+    pc += 2;
+  }
+}
+
+/*
+ * Encode bytes in base-16, for use when m_hex is set.
+ * 
+ * The bytes are converted with hex_block() and written with
+ * write_block(), in pieces that are split at segment boundaries and
+ * index points.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to encode
+ * 
+ *   len - the number of bytes to encode
+ */
+static void encode_hex(const uint8_t *pb, int32_t len) {
+  
+  static char s_buf[2 * ENCODE_BUF];
+  
+  int32_t n = 0;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (len < 0)) {
+    abort();
+  }
+  
+  /* Encode the bytes in pieces */
+  while (len > 0) {
+    /* Handle a segment boundary or index point */
+    if ((m_in_count == m_index_next) || (m_in_count == m_seg_next)) {
+      encode_point();
+    }
+    
+    /* Determine the size of this piece */
+    n = len;
+    if (n > ENCODE_BUF) {
+      n = ENCODE_BUF;
+    }
+    n = (int32_t) encode_run_limit(n, 1);
     
-    /* Reset processor count */
-    pcount = 0;
+    /* Convert and write the piece */
+    hex_block(pb, n, s_buf);
+    write_block(s_buf, ((int64_t) n) * 2);
     
-    /* Accumulate all the data */
-    while (pcount < rcount) {
-      /* Add another byte to the accumulator */
-      eax = (eax << 8) | ((uint32_t) buf[pcount]);
-      cx++;
-      pcount++;
-      
-      /* If we got a full accumulator, encode that without any padding
-       * and reset accumulator */
-      if (cx >= 4) {
-        encode_dword(eax, 0);
-        eax = 0;
-        cx = 0;
+    m_in_count += n;
+    pb += n;
+    len -= n;
+  }
+}
+
+/*
+ * Add bytes to the Base-85 accumulator, encoding each dword as soon as
+ * it is complete.
+ * 
+ * Any bytes that do not complete a dword remain in the m_acc
+ * accumulator until the next call.  Use encode_finish() after all the
+ * input has been given to flush a partial dword.
+ * 
+ * In SEG_STREAM mode, bytes beyond the expected input length are only
+ * counted and not encoded.  See encode_excess() for further
+ * information.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to encode
+ * 
+ *   len - the number of bytes to encode
+ */
+static void encode_bytes(const uint8_t *pb, int32_t len) {
+  
+  int32_t i = 0;
+  int32_t excess = 0;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (len < 0)) {
+    abort();
+  }
+  
+  /* Encode only the bytes within the expected input length, and just
+   * count the rest */
+  excess = (int32_t) encode_excess(len);
+  if (excess > 0) {
+    encode_bytes(pb, len - excess);
+    m_in_count += excess;
+    return;
+  }
+  
+  /* Add the data to the input checksum */
+  sum_update(pb, len);
+  
+  /* In base-16 mode, there is no accumulator */
+  if (m_hex) {
+    encode_hex(pb, len);
+    return;
+  }
+  
+  /* Accumulate all the data */
+  for(i = 0; i < len; i++) {
+    /* If this byte begins a dword at a segment boundary or an index
+     * point, handle that before the dword is encoded */
+    if ((m_acc_count == 0) &&
+        ((m_in_count == m_index_next) || (m_in_count == m_seg_next))) {
+      encode_point();
+    }
+    
+    /* Add another byte to the accumulator */
+    m_acc = (m_acc << 8) | ((uint32_t) pb[i]);
+    m_acc_count++;
+    m_in_count++;
+    
+    /* If we got a full accumulator, encode that without any padding and
+     * reset accumulator */
+    if (m_acc_count >= 4) {
+      encode_dword(m_acc, 0);
+      m_acc = 0;
+      m_acc_count = 0;
+    }
+  }
+}
+
+#ifdef PSDATA_SPARSE
+/*
+ * Add a run of zero bytes to the Base-85 accumulator.
+ * 
+ * This has the same effect as passing count zero bytes to
+ * encode_bytes(), except that no input buffer is required.  Zero bytes
+ * are added one at a time only until the accumulator is aligned to a
+ * dword boundary; after that, whole zero dwords are encoded directly,
+ * and any remaining zero bytes are left in the accumulator.
+ * 
+ * In SEG_STREAM mode, zero bytes beyond the expected input length are
+ * only counted, as with encode_bytes().
+ * 
+ * Parameters:
+ * 
+ *   count - the number of zero bytes to encode
+ */
+static void encode_zeros(int64_t count) {
+  
+  int64_t run = 0;
+  int64_t excess = 0;
+  
+  /* Check parameter */
+  if (count < 0) {
+    abort();
+  }
+  
+  /* Encode only the zero bytes within the expected input length, and
+   * just count the rest */
+  excess = encode_excess(count);
+  if (excess > 0) {
+    encode_zeros(count - excess);
+    m_in_count += excess;
+    return;
+  }
+  
+  /* Add the zero bytes to the input checksum */
+  sum_zeros(count);
+  
+  /* In base-16 mode, each zero byte is two zero digits, so encode runs
+   * of them split at segment boundaries and index points */
+  if (m_hex) {
+    while (count > 0) {
+      if ((m_in_count == m_index_next) || (m_in_count == m_seg_next)) {
+        encode_point();
       }
+      
+      run = encode_run_limit(count, 1);
+      write_run('0', run * 2);
+      m_in_count += run;
+      count -= run;
     }
+    return;
   }
   
-  /* Check whether we stopped because end of input reached or error */
-  if (!feof(stdin)) {
-    /* Not EOF, so must be a read error */
-    status = 0;
+  /* Complete any partial dword that is in the accumulator */
+  while ((m_acc_count > 0) && (count > 0)) {
+    m_acc <<= 8;
+    m_acc_count++;
+    m_in_count++;
+    count--;
+    
+    if (m_acc_count >= 4) {
+      encode_dword(m_acc, 0);
+      m_acc = 0;
+      m_acc_count = 0;
+    }
   }
   
-  /* If partial data remains in accumulator, pad and output the dword
-   * with padding */
-  if (cx > 0) {
-    /* Reset padding count */
-    pcount = 0;
+  /* Encode all the whole zero dwords as runs of "z" codes, or runs of
+   * "!!!!!" if the "z" code is disabled, splitting the runs at segment
+   * boundaries and index points */
+  while (count >= 4) {
+    if ((m_in_count == m_index_next) || (m_in_count == m_seg_next)) {
+      encode_point();
+    }
     
+    run = encode_run_limit(count / 4, 4);
+    
+    if (m_noz) {
+      write_run('!', run * 5);
+    } else {
+      write_run('z', run);
+    }
+    m_in_count += run * 4;
+    count -= run * 4;
+  }
+  
+  /* Leave any remaining zero bytes in the accumulator, handling a
+   * segment boundary or index point first if they begin a dword
+   * there */
+  if ((count > 0) &&
+      ((m_in_count == m_index_next) || (m_in_count == m_seg_next))) {
+    encode_point();
+  }
+  m_acc <<= (8 * ((int) count));
+  m_acc_count += (int) count;
+  m_in_count += count;
+}
+#endif
+
+/*
+ * Handle a segment boundary or index point at the current input
+ * offset.
+ * 
+ * This must be called when the accumulator is empty and m_in_count
+ * equals m_seg_next or m_index_next, before the next dword is encoded.
+ * A segment boundary is handled first, so that an index entry at the
+ * same offset records the position in the new segment.
+ */
+static void encode_point(void) {
+  
+  /* Check state */
+  if (m_acc_count != 0) {
+    abort();
+  }
+  
+  /* Handle segment boundary */
+  if (m_in_count == m_seg_next) {
+    seg_break();
+  }
+  
+  /* Handle index point */
+  if (m_in_count == m_index_next) {
+    index_mark();
+  }
+}
+
+/*
+ * Limit a run of input units so that it does not cross the next
+ * segment boundary or index point.
+ * 
+ * The units are dwords (unit is four) for runs of zero dwords in
+ * Base-85, or bytes (unit is one) in base-16.  This may only be used
+ * when the accumulator is empty.
+ * 
+ * Parameters:
+ * 
+ *   run - the number of units in the run
+ * 
+ *   unit - the number of input bytes in each unit
+ * 
+ * Return:
+ * 
+ *   the number of units that can be encoded before the next segment
+ *   boundary or index point
+ */
+static int64_t encode_run_limit(int64_t run, int unit) {
+  
+  /* Check state and parameters */
+  if ((m_acc_count != 0) || (run < 0) || (unit < 1)) {
+    abort();
+  }
+  
+  /* Limit to the next index point */
+  if ((m_index_next > m_in_count) &&
+      ((m_index_next - m_in_count) / unit < run)) {
+    run = (m_index_next - m_in_count) / unit;
+  }
+  
+  /* Limit to the next segment boundary */
+  if ((m_seg_next > m_in_count) &&
+      ((m_seg_next - m_in_count) / unit < run)) {
+    run = (m_seg_next - m_in_count) / unit;
+  }
+  
+  return run;
+}
+
+/*
+ * Determine how many of the next input bytes lie beyond the expected
+ * input length.
+ * 
+ * In SEG_STREAM mode, the line counts of the %%BeginData tags have been
+ * predicted from m_seg_len, so input beyond that length must not be
+ * encoded, or the output would no longer match the tags that were
+ * already written.  The encoding functions only count such bytes in
+ * m_in_count, so that the mismatch with the expected length is
+ * reported once all input has been read.  In the other modes, all
+ * input is encoded.
+ * 
+ * Parameters:
+ * 
+ *   len - the number of bytes about to be encoded
+ * 
+ * Return:
+ * 
+ *   the number of those bytes that must only be counted
+ */
+static int64_t encode_excess(int64_t len) {
+  
+  int64_t room = 0;
+  
+  /* Check parameter */
+  if (len < 0) {
+    abort();
+  }
+  
+  /* All input is encoded unless streaming */
+  if (m_seg_mode != SEG_STREAM) {
+    return 0;
+  }
+  
+  /* Determine how much input can still be encoded */
+  room = m_seg_len - m_in_count;
+  if (room < 0) {
+    room = 0;
+  }
+  
+  if (len > room) {
+    return len - room;
+  }
+  return 0;
+}
+
+/*
+ * Flush any partial dword remaining in the Base-85 accumulator.
+ * 
+ * If partial data remains, it is padded with zero bytes and encoded
+ * with padding.  The accumulator is empty when this function returns.
+ */
+static void encode_finish(void) {
+  
+  int pad = 0;
+  
+  /* Only do something if partial data remains in accumulator */
+  if (m_acc_count > 0) {
     /* Pad */
-    while (cx < 4) {
-      eax <<= 8;
-      cx++;
-      pcount++;
+    while (m_acc_count < 4) {
+      m_acc <<= 8;
+      m_acc_count++;
+      pad++;
+    }
+    
+    /* Output with padding and reset accumulator */
+    encode_dword(m_acc, pad);
+    m_acc = 0;
+    m_acc_count = 0;
+  }
+}
+
+#ifdef PSDATA_SPARSE
+/*
+ * Encode an input file by scanning it for holes.
+ * 
+ * This is only attempted if the input file is a regular file.  The
+ * file is walked extent by extent with the SEEK_DATA and SEEK_HOLE
+ * extensions to lseek().  Data extents are read and encoded normally,
+ * while hole extents are passed to encode_zeros() without reading them
+ * from the file.  Since holes may begin and end at any byte offset, the
+ * accumulator takes care of dword alignment across extent boundaries.
+ * 
+ * Once the last data extent has been found, the trailing hole up to
+ * the current file size is encoded, and then anything that can still
+ * be read from the file is encoded, in case the file grew during the
+ * scan.
+ * 
+ * This function reads from the file descriptor of the input file
+ * directly, so the FILE handle must not have any buffered input.  If
+ * the input file is not a regular file, or if the file system does not
+ * support hole detection, zero is returned without anything having
+ * been encoded or read.  In that case, the caller should read the input
+ * normally.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ *   pstatus - receives non-zero if successful, zero if error
+ * 
+ * Return:
+ * 
+ *   non-zero if the input was handled, zero if it must be read
+ *   normally
+ */
+static int encode_sparse(FILE *pIn, int *pstatus) {
+  
+  static uint8_t buf[ENCODE_BUF];
+  
+  struct stat st;
+  int fd = 0;
+  off_t pos = 0;
+  off_t data = 0;
+  off_t hole = 0;
+  ssize_t rcount = 0;
+  size_t rlen = 0;
+  int first = 1;
+  int done = 0;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (pstatus == NULL)) {
+    abort();
+  }
+  *pstatus = 1;
+  
+  /* Only regular files are scanned for holes */
+  fd = fileno(pIn);
+  if (fstat(fd, &st) != 0) {
+    return 0;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  
+  /* Begin at the current position of the file descriptor, in case the
+   * input file was opened and partially consumed by someone else */
+  pos = lseek(fd, 0, SEEK_CUR);
+  if (pos < 0) {
+    return 0;
+  }
+  
+  /* Walk all the data extents */
+  while (!done) {
+    
+    /* Find the start of the next data extent */
+    data = lseek(fd, pos, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO) {
+        /* No more data extents, so the rest of the file is a hole */
+        break;
+      } else if (first) {
+        /* Hole detection is not supported, so restore the position and
+         * fall back to reading normally */
+        if (lseek(fd, pos, SEEK_SET) < 0) {
+          *pstatus = 0;
+          return 1;
+        }
+        return 0;
+      } else {
+        *pstatus = 0;
+        return 1;
+      }
+    }
+    first = 0;
+    
+    /* Find the end of this data extent */
+    hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0) {
+      *pstatus = 0;
+      return 1;
+    }
+    
+    /* Encode the hole before the data extent without reading it */
+    if (data > pos) {
+      PSDATA_PROBE(hole, data - pos);
+      encode_zeros((int64_t) (data - pos));
+      pos = data;
+    }
+    
+    /* Position at the start of the data extent */
+    if (lseek(fd, pos, SEEK_SET) < 0) {
+      *pstatus = 0;
+      return 1;
+    }
+    
+    /* Read and encode the data extent */
+    while (pos < hole) {
+      if ((hole - pos) > ENCODE_BUF) {
+        rlen = ENCODE_BUF;
+      } else {
+        rlen = (size_t) (hole - pos);
+      }
+      
+      rcount = read(fd, buf, rlen);
+      if (rcount < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        *pstatus = 0;
+        return 1;
+      
+      } else if (rcount == 0) {
+        /* File was truncated while we were scanning it */
+        done = 1;
+        break;
+      }
+      
+      PSDATA_PROBE(read, rcount);
+      encode_bytes(buf, (int32_t) rcount);
+      pos += (off_t) rcount;
+    }
+  }
+  
+  /* Encode the trailing hole, if there is one */
+  if (!done) {
+    if (fstat(fd, &st) != 0) {
+      *pstatus = 0;
+      return 1;
+    }
+    if (st.st_size > pos) {
+      PSDATA_PROBE(hole, st.st_size - pos);
+      encode_zeros((int64_t) (st.st_size - pos));
+      pos = st.st_size;
+    }
+    if (lseek(fd, pos, SEEK_SET) < 0) {
+      *pstatus = 0;
+      return 1;
+    }
+  }
+  
+  /* Encode anything that was appended to the file during the scan */
+  for(rcount = read(fd, buf, ENCODE_BUF);
+      rcount != 0;
+      rcount = read(fd, buf, ENCODE_BUF)) {
+    if (rcount < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      *pstatus = 0;
+      break;
+    }
+    PSDATA_PROBE(read, rcount);
+    encode_bytes(buf, (int32_t) rcount);
+  }
+  
+  /* Input was handled */
+  return 1;
+}
+#endif
+
+/*
+ * Read all binary data from an input file, encode it in Base-85, and
+ * write the Base-85 characters to the write_char() function.
+ * 
+ * The input file is normally standard input.  If it is a regular file
+ * and sparse file support is available, holes in the file are encoded
+ * without reading them.  See encode_sparse() for further information.
+ * 
+ * See the write_char() function for further information about output.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int encode_input(FILE *pIn) {
+  
+  static uint8_t buf[ENCODE_BUF];
+  
+  int status = 1;
+  int32_t rcount = 0;
+  
+  /* Check parameter */
+  if (pIn == NULL) {
+    abort();
+  }
+  
+  /* Clear the encoding buffer */
+  memset(buf, 0, ENCODE_BUF);
+  
+  /* Try scanning for holes if supported */
+#ifdef PSDATA_SPARSE
+  if (encode_sparse(pIn, &status)) {
+    encode_finish();
+    return status;
+  }
+#endif
+  
+  /* Keep processing while we read data */
+  for(rcount = (int32_t) fread(buf, 1, ENCODE_BUF, pIn);
+      rcount > 0;
+      rcount = (int32_t) fread(buf, 1, ENCODE_BUF, pIn)) {
+    PSDATA_PROBE(read, rcount);
+    encode_bytes(buf, rcount);
+  }
+  
+  /* Check whether we stopped because end of input reached or error */
+  if (!feof(pIn)) {
+    /* Not EOF, so must be a read error */
+    status = 0;
+  }
+  
+  /* If partial data remains in accumulator, pad and output the dword
+   * with padding */
+  encode_finish();
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Determine the number of bytes remaining in an input file without
+ * reading it.
+ * 
+ * This is only possible if the input file is a regular file on a POSIX
+ * platform, in which case the length is the file size less the current
+ * position.  The FILE handle must not have any buffered input.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the input file
+ * 
+ *   plen - receives the input length if successful
+ * 
+ * Return:
+ * 
+ *   non-zero if the length is known, zero if not
+ */
+static int input_length(FILE *pIn, int64_t *plen) {
+  
+#ifndef PSDATA_WIN
+  struct stat st;
+  off_t pos = 0;
+#endif
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (plen == NULL)) {
+    abort();
+  }
+  
+#ifdef PSDATA_WIN
+  return 0;
+#else
+  /* Only regular files have a known length */
+  memset(&st, 0, sizeof(struct stat));
+  if (fstat(fileno(pIn), &st) != 0) {
+    return 0;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  
+  /* Get the current position */
+  pos = lseek(fileno(pIn), 0, SEEK_CUR);
+  if ((pos < 0) || (pos > st.st_size)) {
+    return 0;
+  }
+  
+  *plen = (int64_t) (st.st_size - pos);
+  return 1;
+#endif
+}
+
+#if defined(PSDATA_CRC_SSE42) || defined(PSDATA_CRC_ARM)
+/*
+ * Update the CRC32C register with the given bytes using the hardware
+ * CRC32C instructions, eight bytes at a time while possible.
+ * 
+ * With PSDATA_CRC_DISPATCH, this function is compiled for SSE4.2 even
+ * though the rest of the program is not, so it may only be called once
+ * crc_update() has checked that the processor supports SSE4.2.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to add
+ * 
+ *   len - the number of bytes to add
+ */
+#ifdef PSDATA_CRC_DISPATCH
+__attribute__((target("sse4.2")))
+#endif
+static void crc_update_hw(const uint8_t *pb, int32_t len) {
+  
+  uint64_t qw = 0;
+  
+  /* Process eight bytes at a time while possible */
+  for( ; len >= 8; len -= 8) {
+    memcpy(&qw, pb, 8);
+#ifdef PSDATA_CRC_SSE42
+    m_crc = (uint32_t) _mm_crc32_u64(m_crc, qw);
+#else
+    m_crc = __crc32cd(m_crc, qw);
+#endif
+    pb += 8;
+  }
+  
+  /* Process any remaining bytes */
+  for( ; len > 0; len--) {
+#ifdef PSDATA_CRC_SSE42
+    m_crc = _mm_crc32_u8(m_crc, *pb);
+#else
+    m_crc = __crc32cb(m_crc, *pb);
+#endif
+    pb++;
+  }
+}
+#endif
+
+#if !defined(PSDATA_CRC_SSE42) || defined(PSDATA_CRC_DISPATCH)
+/*
+ * Update the CRC32C register with the given bytes using lookup tables.
+ * 
+ * Eight lookup tables are computed on first use.  Table k holds the
+ * effect of a byte followed by k zero bytes, so that eight bytes can be
+ * processed with one lookup in each table ("slicing-by-8").  Any
+ * remaining bytes are processed one at a time with table zero.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to add
+ * 
+ *   len - the number of bytes to add
+ */
+static void crc_update_table(const uint8_t *pb, int32_t len) {
+  
+  static uint32_t s_table[8][256];
+  static int s_table_init = 0;
+  
+  int32_t i = 0;
+  int32_t j = 0;
+  uint32_t r = 0;
+  
+  /* Compute the lookup tables if necessary */
+  if (!s_table_init) {
+    for(i = 0; i < 256; i++) {
+      r = (uint32_t) i;
+      for(j = 0; j < 8; j++) {
+        if (r & 1) {
+          r = (r >> 1) ^ CRC32C_POLY;
+        } else {
+          r = r >> 1;
+        }
+      }
+      s_table[0][i] = r;
+    }
+    for(i = 0; i < 256; i++) {
+      for(j = 1; j < 8; j++) {
+        r = s_table[j - 1][i];
+        s_table[j][i] = (r >> 8) ^ s_table[0][r & 0xff];
+      }
+    }
+    s_table_init = 1;
+  }
+  
+  /* Process eight bytes at a time while possible */
+  for( ; len >= 8; len -= 8) {
+    r = m_crc ^ (((uint32_t) pb[0]) | (((uint32_t) pb[1]) << 8) |
+          (((uint32_t) pb[2]) << 16) | (((uint32_t) pb[3]) << 24));
+    m_crc = s_table[7][r & 0xff] ^ s_table[6][(r >> 8) & 0xff] ^
+            s_table[5][(r >> 16) & 0xff] ^ s_table[4][r >> 24] ^
+            s_table[3][pb[4]] ^ s_table[2][pb[5]] ^
+            s_table[1][pb[6]] ^ s_table[0][pb[7]];
+    pb += 8;
+  }
+  
+  /* Process any remaining bytes */
+  for( ; len > 0; len--) {
+    m_crc = (m_crc >> 8) ^ s_table[0][(m_crc ^ (*pb)) & 0xff];
+    pb++;
+  }
+}
+#endif
+
+/*
+ * Update the CRC32C register with the given bytes.
+ * 
+ * This uses crc_update_hw() if hardware CRC32C instructions are
+ * available, and otherwise crc_update_table().  With
+ * PSDATA_CRC_DISPATCH, the processor is checked for SSE4.2 support on
+ * first use.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to add
+ * 
+ *   len - the number of bytes to add
+ */
+static void crc_update(const uint8_t *pb, int32_t len) {
+  
+#ifdef PSDATA_CRC_DISPATCH
+  static int s_hw = -1;
+#endif
+  
+  /* Check parameters */
+  if ((pb == NULL) || (len < 0)) {
+    abort();
+  }
+  
+#if defined(PSDATA_CRC_DISPATCH)
+  /* Check for SSE4.2 support on first use */
+  if (s_hw < 0) {
+    if (__builtin_cpu_supports("sse4.2")) {
+      s_hw = 1;
+    } else {
+      s_hw = 0;
+    }
+  }
+  
+  if (s_hw) {
+    crc_update_hw(pb, len);
+  } else {
+    crc_update_table(pb, len);
+  }
+  
+#elif defined(PSDATA_CRC_SSE42) || defined(PSDATA_CRC_ARM)
+  crc_update_hw(pb, len);
+#else
+  crc_update_table(pb, len);
+#endif
+}
+
+#ifdef PSDATA_SPARSE
+/*
+ * Update the CRC32C register with a run of zero bytes.
+ * 
+ * Appending zero bits to the register is a linear operation over
+ * GF(2), so instead of processing each zero byte, the register is
+ * multiplied by the 32x32 bit matrices for 2^k zero bytes, squaring
+ * the matrix for each bit of count.  This takes time proportional to
+ * the logarithm of count.
+ * 
+ * Parameters:
+ * 
+ *   count - the number of zero bytes to add
+ */
+static void crc_zeros(int64_t count) {
+  
+  uint32_t mat[32];
+  uint32_t sq[32];
+  uint32_t v = 0;
+  uint32_t r = 0;
+  const uint32_t *pm = NULL;
+  int i = 0;
+  int k = 0;
+  
+  /* Check parameter */
+  if (count < 0) {
+    abort();
+  }
+  
+  /* Compute the matrix for a single zero bit */
+  mat[0] = CRC32C_POLY;
+  for(i = 1; i < 32; i++) {
+    mat[i] = ((uint32_t) 1) << (i - 1);
+  }
+  
+  /* Square three times to get the matrix for a single zero byte */
+  for(k = 0; k < 3; k++) {
+    for(i = 0; i < 32; i++) {
+      v = mat[i];
+      r = 0;
+      for(pm = mat; v != 0; v >>= 1, pm++) {
+        if (v & 1) {
+          r ^= *pm;
+        }
+      }
+      sq[i] = r;
+    }
+    memcpy(mat, sq, sizeof(mat));
+  }
+  
+  /* Apply the matrix for each set bit of count, squaring the matrix
+   * for each successive bit */
+  while (count > 0) {
+    if (count & 1) {
+      v = m_crc;
+      r = 0;
+      for(pm = mat; v != 0; v >>= 1, pm++) {
+        if (v & 1) {
+          r ^= *pm;
+        }
+      }
+      m_crc = r;
+    }
+    
+    count >>= 1;
+    if (count > 0) {
+      for(i = 0; i < 32; i++) {
+        v = mat[i];
+        r = 0;
+        for(pm = mat; v != 0; v >>= 1, pm++) {
+          if (v & 1) {
+            r ^= *pm;
+          }
+        }
+        sq[i] = r;
+      }
+      memcpy(mat, sq, sizeof(mat));
+    }
+  }
+}
+#endif
+
+/*
+ * Process one full 64-byte block with the SHA-256 compression function
+ * and update the m_sha_state chaining state.
+ * 
+ * Parameters:
+ * 
+ *   pb - the block to process
+ */
+static void sha_block(const uint8_t *pb) {
+  
+  uint32_t w[64];
+  uint32_t a[8];
+  uint32_t t1 = 0;
+  uint32_t t2 = 0;
+  int i = 0;
+  
+  /* Check parameter */
+  if (pb == NULL) {
+    abort();
+  }
+  
+  /* Build the message schedule */
+  for(i = 0; i < 16; i++) {
+    w[i] = (((uint32_t) pb[4 * i    ]) << 24) |
+           (((uint32_t) pb[4 * i + 1]) << 16) |
+           (((uint32_t) pb[4 * i + 2]) <<  8) |
+            ((uint32_t) pb[4 * i + 3]);
+  }
+  for(i = 16; i < 64; i++) {
+    t1 = w[i - 2];
+    t2 = w[i - 15];
+    w[i] = (((t1 >> 17) | (t1 << 15)) ^ ((t1 >> 19) | (t1 << 13)) ^
+              (t1 >> 10))
+          + w[i - 7]
+          + (((t2 >> 7) | (t2 << 25)) ^ ((t2 >> 18) | (t2 << 14)) ^
+              (t2 >> 3))
+          + w[i - 16];
+  }
+  
+  /* Run the rounds */
+  memcpy(a, m_sha_state, sizeof(a));
+  for(i = 0; i < 64; i++) {
+    t1 = a[7]
+          + (((a[4] >> 6) | (a[4] << 26)) ^
+             ((a[4] >> 11) | (a[4] << 21)) ^
+             ((a[4] >> 25) | (a[4] << 7)))
+          + ((a[4] & a[5]) ^ ((~a[4]) & a[6]))
+          + m_sha_k[i] + w[i];
+    t2 = (((a[0] >> 2) | (a[0] << 30)) ^
+          ((a[0] >> 13) | (a[0] << 19)) ^
+          ((a[0] >> 22) | (a[0] << 10)))
+          + ((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+    a[7] = a[6];
+    a[6] = a[5];
+    a[5] = a[4];
+    a[4] = a[3] + t1;
+    a[3] = a[2];
+    a[2] = a[1];
+    a[1] = a[0];
+    a[0] = t1 + t2;
+  }
+  
+  /* Add the result into the chaining state */
+  for(i = 0; i < 8; i++) {
+    m_sha_state[i] += a[i];
+  }
+}
+
+/*
+ * Add bytes to the SHA-256 hash.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to add
+ * 
+ *   len - the number of bytes to add
+ */
+static void sha_update(const uint8_t *pb, int32_t len) {
+  
+  int32_t blen = 0;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (len < 0)) {
+    abort();
+  }
+  
+  /* Update the total length */
+  m_sha_len += (uint64_t) len;
+  
+  /* Complete a partial block if there is one */
+  if (m_sha_fill > 0) {
+    blen = SHA256_BLOCK - m_sha_fill;
+    if (blen > len) {
+      blen = len;
+    }
+    memcpy(&(m_sha_block[m_sha_fill]), pb, (size_t) blen);
+    m_sha_fill += blen;
+    pb += blen;
+    len -= blen;
+    
+    if (m_sha_fill >= SHA256_BLOCK) {
+      sha_block(m_sha_block);
+      m_sha_fill = 0;
+    }
+  }
+  
+  /* Process full blocks directly from the input */
+  for( ; len >= SHA256_BLOCK; len -= SHA256_BLOCK) {
+    sha_block(pb);
+    pb += SHA256_BLOCK;
+  }
+  
+  /* Keep any remaining bytes as a partial block */
+  if (len > 0) {
+    memcpy(m_sha_block, pb, (size_t) len);
+    m_sha_fill = len;
+  }
+}
+
+/*
+ * Select the input checksum algorithm and reset its state.
+ * 
+ * Parameters:
+ * 
+ *   sum_type - one of the SUM_ constants
+ */
+static void sum_init(int sum_type) {
+  
+  /* Check parameter */
+  if ((sum_type != SUM_NONE) && (sum_type != SUM_CRC32C) &&
+      (sum_type != SUM_SHA256)) {
+    abort();
+  }
+  
+  /* Reset all the state */
+  m_sum_type = sum_type;
+  
+  m_crc = 0xffffffffUL;
+  
+  m_sha_state[0] = 0x6a09e667UL;
+  m_sha_state[1] = 0xbb67ae85UL;
+  m_sha_state[2] = 0x3c6ef372UL;
+  m_sha_state[3] = 0xa54ff53aUL;
+  m_sha_state[4] = 0x510e527fUL;
+  m_sha_state[5] = 0x9b05688cUL;
+  m_sha_state[6] = 0x1f83d9abUL;
+  m_sha_state[7] = 0x5be0cd19UL;
+  memset(m_sha_block, 0, SHA256_BLOCK);
+  m_sha_fill = 0;
+  m_sha_len = 0;
+}
+
+/*
+ * Add input bytes to the selected checksum, if any.
+ * 
+ * Parameters:
+ * 
+ *   pb - the bytes to add
+ * 
+ *   len - the number of bytes to add
+ */
+static void sum_update(const uint8_t *pb, int32_t len) {
+  if (m_sum_type == SUM_CRC32C) {
+    crc_update(pb, len);
+  } else if (m_sum_type == SUM_SHA256) {
+    sha_update(pb, len);
+  }
+}
+
+#ifdef PSDATA_SPARSE
+/*
+ * Add a run of zero input bytes to the selected checksum, if any.
+ * 
+ * CRC32C handles this arithmetically with crc_zeros().  SHA-256 has no
+ * such shortcut, so the zero bytes are hashed from a static buffer,
+ * which still does not require reading them from input.
+ * 
+ * Parameters:
+ * 
+ *   count - the number of zero bytes to add
+ */
+static void sum_zeros(int64_t count) {
+  
+  static uint8_t s_zero[ENCODE_BUF];
+  
+  int32_t blen = 0;
+  
+  /* Check parameter */
+  if (count < 0) {
+    abort();
+  }
+  
+  /* Update the checksum */
+  if (m_sum_type == SUM_CRC32C) {
+    crc_zeros(count);
+  
+  } else if (m_sum_type == SUM_SHA256) {
+    while (count > 0) {
+      if (count > ENCODE_BUF) {
+        blen = ENCODE_BUF;
+      } else {
+        blen = (int32_t) count;
+      }
+      sha_update(s_zero, blen);
+      count -= blen;
+    }
+  }
+}
+#endif
+
+/*
+ * Get the name of the selected checksum algorithm.
+ * 
+ * This may not be used if no checksum is selected.
+ * 
+ * Return:
+ * 
+ *   the algorithm name
+ */
+static const char *sum_name(void) {
+  
+  const char *pName = NULL;
+  
+  if (m_sum_type == SUM_CRC32C) {
+    pName = "crc32c";
+  } else if (m_sum_type == SUM_SHA256) {
+    pName = "sha256";
+  } else {
+    abort();
+  }
+  
+  return pName;
+}
+
+/*
+ * Finish the selected checksum and write it as a nul-terminated string
+ * of lowercase base-16 digits.
+ * 
+ * pstr must have room for at least (2 * SHA256_DIGEST + 1) characters.
+ * This may only be called once after all the input has been added, and
+ * it may not be used if no checksum is selected.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the buffer to receive the checksum string
+ */
+static void sum_hex(char *pstr) {
+  
+  static const char *s_digits = "0123456789abcdef";
+  
+  uint8_t digest[SHA256_DIGEST];
+  uint8_t pad[SHA256_BLOCK + 8];
+  uint64_t bits = 0;
+  int32_t dlen = 0;
+  int32_t plen = 0;
+  int32_t i = 0;
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Initialize buffers */
+  memset(digest, 0, SHA256_DIGEST);
+  memset(pad, 0, SHA256_BLOCK + 8);
+  
+  /* Compute the digest bytes in big endian order */
+  if (m_sum_type == SUM_CRC32C) {
+    m_crc = m_crc ^ 0xffffffffUL;
+    for(i = 0; i < 4; i++) {
+      digest[i] = (uint8_t) (m_crc >> (24 - (8 * i)));
+    }
+    dlen = 4;
+    
+  } else if (m_sum_type == SUM_SHA256) {
+    /* Pad with a one bit, then zero bits until the length is 56 mod
+     * 64, then the 64-bit message length in bits */
+    bits = m_sha_len * 8;
+    pad[0] = 0x80;
+    plen = (SHA256_BLOCK + 56 - (m_sha_fill + 1)) % SHA256_BLOCK + 1;
+    for(i = 0; i < 8; i++) {
+      pad[plen + i] = (uint8_t) (bits >> (56 - (8 * i)));
+    }
+    sha_update(pad, plen + 8);
+    
+    for(i = 0; i < SHA256_DIGEST; i++) {
+      digest[i] = (uint8_t) (m_sha_state[i / 4] >> (24 - (8 * (i % 4))));
+    }
+    dlen = SHA256_DIGEST;
+    
+  } else {
+    abort();
+  }
+  
+  /* Convert to base-16 */
+  for(i = 0; i < dlen; i++) {
+    pstr[2 * i] = s_digits[digest[i] >> 4];
+    pstr[2 * i + 1] = s_digits[digest[i] & 0xf];
+  }
+  pstr[2 * dlen] = (char) 0;
+}
+
+/*
+ * Write a PostScript comment line to output with write_char().
+ * 
+ * The comment must begin at the start of a line.  pstr is the text of
+ * the comment, not including the leading percent sign.  It may only
+ * contain characters in range [0x20, 0x7e].  If the comment does not
+ * fit within the maximum line length, it is continued on further
+ * comment lines that each begin with a percent sign.  The final line
+ * is terminated with a line break.
+ * 
+ * Since the comment is written through write_char(), its lines are
+ * included in m_line_count.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the comment text
+ */
+static void write_comment(const char *pstr) {
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Write the comment, inserting explicit continuations */
+  write_char('%');
+  for( ; *pstr != 0; pstr++) {
+    if (m_line_pos >= m_line_len) {
+      write_char('\n');
+      write_char('%');
+    }
+    write_char(*pstr);
+  }
+  write_char('\n');
+}
+
+/*
+ * Write the checksum comment line for the -sum option with
+ * write_comment(), and optionally also report the checksum on standard
+ * error.
+ * 
+ * The comment text is SUM_PREFIX, the algorithm name, a space, and the
+ * checksum in base-16.  The report on standard error omits SUM_PREFIX.
+ * 
+ * This finalizes the checksum with sum_hex(), so it may only be called
+ * once all input has been added to the checksum.  A checksum must be
+ * selected.
+ * 
+ * Parameters:
+ * 
+ *   report - non-zero to also report the checksum on standard error
+ */
+static void write_sum(int report) {
+  
+  char str[sizeof(SUM_PREFIX) + 2 * SHA256_DIGEST + 16];
+  
+  /* Check state */
+  if (m_sum_type == SUM_NONE) {
+    abort();
+  }
+  
+  /* Build and write the comment */
+  memset(str, 0, sizeof(str));
+  strcpy(str, SUM_PREFIX);
+  strcat(str, sum_name());
+  strcat(str, " ");
+  sum_hex(str + strlen(str));
+  write_comment(str);
+  
+  /* Report on standard error if requested */
+  if (report) {
+    fprintf(stderr, "%s: %s\n", pModule, str + (sizeof(SUM_PREFIX) - 1));
+  }
+}
+
+/*
+ * Seek a file to an absolute byte offset that may be beyond the range
+ * of a long.
+ * 
+ * Parameters:
+ * 
+ *   pf - the file to seek
+ * 
+ *   pos - the byte offset from the start of the file
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int seek_file(FILE *pf, int64_t pos) {
+  
+  int result = 0;
+  
+  /* Check parameters */
+  if ((pf == NULL) || (pos < 0)) {
+    abort();
+  }
+  
+  /* Seek with the platform's 64-bit seek function */
+#ifdef PSDATA_WIN
+  result = _fseeki64(pf, pos, SEEK_SET);
+#else
+  result = fseeko(pf, (off_t) pos, SEEK_SET);
+#endif
+  
+  /* Return status */
+  if (result == 0) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Store an unsigned integer in little endian order.
+ * 
+ * Parameters:
+ * 
+ *   pb - the buffer to receive the bytes
+ * 
+ *   v - the value to store
+ * 
+ *   len - the number of bytes to store, in range [1, 8]
+ */
+static void put_le(uint8_t *pb, uint64_t v, int len) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (len < 1) || (len > 8)) {
+    abort();
+  }
+  
+  /* Store the bytes */
+  for(i = 0; i < len; i++) {
+    pb[i] = (uint8_t) (v & 0xff);
+    v >>= 8;
+  }
+}
+
+/*
+ * Load an unsigned integer stored in little endian order.
+ * 
+ * Parameters:
+ * 
+ *   pb - the buffer holding the bytes
+ * 
+ *   len - the number of bytes to load, in range [1, 8]
+ * 
+ * Return:
+ * 
+ *   the loaded value
+ */
+static uint64_t get_le(const uint8_t *pb, int len) {
+  
+  uint64_t v = 0;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (len < 1) || (len > 8)) {
+    abort();
+  }
+  
+  /* Load the bytes */
+  for(i = len - 1; i >= 0; i--) {
+    v = (v << 8) | ((uint64_t) pb[i]);
+  }
+  
+  return v;
+}
+
+/*
+ * Record an offset index entry for the current input position.
+ * 
+ * This must be called when m_in_count equals m_index_next and the
+ * accumulator is empty, before the dword at that input offset is
+ * encoded.  The entry records the current output position of
+ * write_char(), plus the bytes and lines written outside of buf_char()
+ * so far.  If the current line is full, the next character will be
+ * written after an implicit line break, so the entry is advanced to
+ * the start of the next line.
+ * 
+ * Line numbers in entries count from one, and columns count from zero.
+ */
+static void index_mark(void) {
+  
+  uint8_t ent[INDEX_ENTRY];
+  int64_t off = 0;
+  int64_t line = 0;
+  int32_t col = 0;
+  
+  /* Check state */
+  if ((m_index == NULL) || (m_in_count != m_index_next) ||
+      (m_acc_count != 0)) {
+    abort();
+  }
+  
+  /* Get the output position */
+  off = m_data_count + m_seg_extra_off;
+  line = ((int64_t) m_line_count) + m_seg_extra_line + 1;
+  col = m_line_pos;
+  
+  /* If the line is full, advance to the next line */
+  if (col >= m_line_len) {
+#ifdef PSDATA_WIN
+    off += 2;
+#else
+    off += 1;
+#endif
+    line++;
+    col = 0;
+  }
+  
+  /* Write the entry */
+  memset(ent, 0, INDEX_ENTRY);
+  put_le(ent, (uint64_t) off, 8);
+  put_le(ent + 8, (uint64_t) line, 4);
+  put_le(ent + 12, (uint64_t) col, 4);
+  
+  if (fwrite(ent, 1, INDEX_ENTRY, m_index) != INDEX_ENTRY) {
+    fprintf(stderr, "%s: I/O error writing to index file!\n", pModule);
+    abort();
+  }
+  
+  /* Advance to the next index point */
+  m_index_count++;
+  if (m_index_next <= INT64_MAX - m_index_step) {
+    m_index_next += m_index_step;
+  } else {
+    m_index_next = -1;
+  }
+}
+
+/*
+ * Complete the offset index file after all input has been encoded.
+ * 
+ * In SEG_SPOOL mode, entries are recorded relative to the data written
+ * through buf_char(), because the tag lines are only written when the
+ * spooled output is transferred.  If any segment of the data stream
+ * was preceded by tag lines, then the shift_off and shift_line of its
+ * segment are added to all of its entries.  In the other modes, the
+ * entries are already complete.  Then, the header is written at the
+ * start of the file.  This may only be used after all segments have
+ * been closed and their shifts are known.
+ * 
+ * The index file has the following format, with all integers unsigned
+ * and little endian:
+ * 
+ *   [0]  8 bytes: ASCII signature "PSDATAIX"
+ *   [8]  4 bytes: format version, currently 1
+ *   [12] 4 bytes: encoding, zero for Base-85 or one for base-16
+ *   [16] 4 bytes: input bytes between entries
+ *   [20] 4 bytes: maximum line length
+ *   [24] 8 bytes: total input length
+ *   [32] 8 bytes: entry count
+ * 
+ * Each entry follows with this format:
+ * 
+ *   [0]  8 bytes: output byte offset
+ *   [8]  4 bytes: output line number, counting from one
+ *   [12] 4 bytes: output column, counting from zero
+ * 
+ * Entry i records where the encoding of the input byte at offset i
+ * times the step begins in the output.
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int index_finish(void) {
+  
+  static uint8_t buf[INDEX_BATCH * INDEX_ENTRY];
+  
+  uint8_t head[INDEX_HEAD];
+  int64_t done = 0;
+  int64_t pos = 0;
+  int32_t batch = 0;
+  int32_t i = 0;
+  int64_t si = 0;
+  uint8_t *pe = NULL;
+  int shifted = 0;
+  
+  /* Check state */
+  if ((m_index == NULL) || (m_seg_count < 1)) {
+    abort();
+  }
+  
+  /* Determine whether any segment is shifted */
+  for(si = 0; (m_seg_mode == SEG_SPOOL) && (si < m_seg_count); si++) {
+    if ((m_seg[si].shift_off > 0) || (m_seg[si].shift_line > 0)) {
+      shifted = 1;
+      break;
+    }
+  }
+  
+  /* Adjust all the entries if there is a shift */
+  if (shifted) {
+    for(done = 0; done < m_index_count; done += batch) {
+      
+      /* Read a batch of entries */
+      if (m_index_count - done > INDEX_BATCH) {
+        batch = INDEX_BATCH;
+      } else {
+        batch = (int32_t) (m_index_count - done);
+      }
+      
+      pos = INDEX_HEAD + (done * INDEX_ENTRY);
+      if (!seek_file(m_index, pos)) {
+        return 0;
+      }
+      if (fread(buf, INDEX_ENTRY, (size_t) batch, m_index)
+            != (size_t) batch) {
+        return 0;
+      }
+      
+      /* Adjust the entries by the shift of the segment holding their
+       * input offset */
+      for(i = 0; i < batch; i++) {
+        si = 0;
+        if (m_seg_chunk > 0) {
+          si = ((done + i) * m_index_step) / m_seg_chunk;
+        }
+        if (si >= m_seg_count) {
+          abort();
+        }
+        
+        pe = &(buf[i * INDEX_ENTRY]);
+        put_le(pe, get_le(pe, 8) + ((uint64_t) m_seg[si].shift_off), 8);
+        put_le(pe + 8,
+          get_le(pe + 8, 4) + ((uint64_t) m_seg[si].shift_line), 4);
+      }
+      
+      /* Write the batch back */
+      if (!seek_file(m_index, pos)) {
+        return 0;
+      }
+      if (fwrite(buf, INDEX_ENTRY, (size_t) batch, m_index)
+            != (size_t) batch) {
+        return 0;
+      }
+    }
+  }
+  
+  /* Write the header */
+  memset(head, 0, INDEX_HEAD);
+  memcpy(head, "PSDATAIX", 8);
+  put_le(head + 8, INDEX_VERSION, 4);
+  put_le(head + 12, (uint64_t) m_hex, 4);
+  put_le(head + 16, (uint64_t) m_index_step, 4);
+  put_le(head + 20, (uint64_t) m_line_len, 4);
+  put_le(head + 24, (uint64_t) m_in_count, 8);
+  put_le(head + 32, (uint64_t) m_index_count, 8);
+  
+  if (!seek_file(m_index, 0)) {
+    return 0;
+  }
+  if (fwrite(head, 1, INDEX_HEAD, m_index) != INDEX_HEAD) {
+    return 0;
+  }
+  if (fflush(m_index)) {
+    return 0;
+  }
+  
+  return 1;
+}
+
+/*
+ * Extract a range of the original input from psdata output, using an
+ * offset index file written when the output was generated.
+ * 
+ * The psdata output is read from standard input, which must be
+ * seekable.  The index entry at or before the start of the range is
+ * looked up, standard input is positioned at the output offset it
+ * records, and the Base-85 data is decoded from there until the whole
+ * range has been written to standard output.  If the range continues
+ * past the end of a segment written with the -chunk option, decoding
+ * continues at the index entry for the start of the next segment.
+ * 
+ * The output offsets in the index are relative to the start of the
+ * psdata output.  If the output was embedded in a larger file that is
+ * given on standard input, base is the byte offset within that file
+ * where the psdata output begins, and it is added to every offset
+ * before seeking.
+ * 
+ * Error messages are reported on standard error.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the offset index file
+ * 
+ *   offset - the input offset of the start of the range
+ * 
+ *   len - the number of bytes in the range
+ * 
+ *   base - the offset of the psdata output within standard input
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int extract_input(
+    const char *pPath,
+    int64_t offset,
+    int64_t len,
+    int64_t base) {
+  
+  static uint8_t obuf[ENCODE_BUF];
+  
+  int status = 1;
+  FILE *pIndex = NULL;
+  uint8_t head[INDEX_HEAD];
+  uint8_t ent[INDEX_ENTRY];
+  uint8_t dw[4];
+  
+  int64_t step = 0;
+  int64_t total = 0;
+  int64_t ecount = 0;
+  int64_t ei = 0;
+  int64_t pos = 0;
+  int64_t end = 0;
+  int32_t ocount = 0;
+  
+  uint64_t grp = 0;
+  int gcount = 0;
+  int dcount = 0;
+  int finished = 0;
+  int hex = 0;
+  int c = 0;
+  int i = 0;
+  
+  /* Initialize buffers */
+  memset(head, 0, INDEX_HEAD);
+  memset(ent, 0, INDEX_ENTRY);
+  memset(dw, 0, 4);
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (offset < 0) || (len < 0) || (base < 0)) {
+    abort();
+  }
+  
+  /* Open the index file and read its header */
+  pIndex = fopen(pPath, "rb");
+  if (pIndex == NULL) {
+    status = 0;
+    fprintf(stderr, "%s: Failed to open index file!\n", pModule);
+  }
+  
+  if (status) {
+    if (fread(head, 1, INDEX_HEAD, pIndex) != INDEX_HEAD) {
+      status = 0;
+      fprintf(stderr, "%s: Failed to read index file header!\n",
+        pModule);
+    }
+  }
+  
+  if (status) {
+    if ((memcmp(head, "PSDATAIX", 8) != 0) ||
+        (get_le(head + 8, 4) != INDEX_VERSION) ||
+        (get_le(head + 12, 4) > 1)) {
+      status = 0;
+      fprintf(stderr, "%s: Index file has unsupported format!\n",
+        pModule);
+    }
+  }
+  
+  if (status) {
+    hex = (int) get_le(head + 12, 4);
+    step = (int64_t) get_le(head + 16, 4);
+    total = (int64_t) get_le(head + 24, 8);
+    ecount = (int64_t) get_le(head + 32, 8);
+    if ((step < 4) || (step % 4 != 0) || (total < 0) || (ecount < 0)) {
+      status = 0;
+      fprintf(stderr, "%s: Index file header is not valid!\n",
+        pModule);
+    }
+  }
+  
+  /* Check that the range is within the input */
+  if (status) {
+    if ((offset > total) || (len > total - offset)) {
+      status = 0;
+      fprintf(stderr, "%s: Extract range exceeds input length!\n",
+        pModule);
+    }
+  }
+  
+  /* Nothing more to do if the range is empty */
+  if (status && (len < 1)) {
+    fclose(pIndex);
+    return 1;
+  }
+  
+  /* Read the index entry at or before the start of the range */
+  if (status) {
+    ei = offset / step;
+    if (ei >= ecount) {
+      status = 0;
+      fprintf(stderr, "%s: Index file is missing entries!\n", pModule);
+    }
+  }
+  
+  if (status) {
+    if (!seek_file(pIndex, INDEX_HEAD + (ei * INDEX_ENTRY))) {
+      status = 0;
+    }
+    if (status) {
+      if (fread(ent, 1, INDEX_ENTRY, pIndex) != INDEX_ENTRY) {
+        status = 0;
+      }
+    }
+    if (!status) {
+      fprintf(stderr, "%s: Failed to read index file entry!\n",
+        pModule);
+    }
+  }
+  
+  /* Position standard input at the recorded output offset */
+  if (status) {
+    if ((get_le(ent, 8) > (uint64_t) (INT64_MAX - base)) ||
+        (!seek_file(stdin, base + (int64_t) get_le(ent, 8)))) {
+      status = 0;
+      fprintf(stderr, "%s: Failed to seek in standard input!\n",
+        pModule);
+    }
+  }
+  
+  /* Decode until the end of the range */
+  if (status) {
+    pos = ei * step;
+    end = offset + len;
+  }
+  while (status && (pos < end)) {
+    
+    /* Decode the next group of bytes into dw */
+    dcount = 0;
+    while (status && (dcount < 1)) {
+      c = getc(stdin);
+      
+      if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') ||
+          (c == '\f') || (c == 0)) {
+        /* Skip whitespace */
+        continue;
+        
+      } else if (hex && (!finished) && (((c >= '0') && (c <= '9')) ||
+                  ((c >= 'A') && (c <= 'F')) || ((c >= 'a') && (c <= 'f')))) {
+        /* Base-16 digit */
+        if (c <= '9') {
+          grp = (grp << 4) | ((uint64_t) (c - '0'));
+        } else {
+          grp = (grp << 4) | ((uint64_t) ((c & 0x0f) + 9));
+        }
+        gcount++;
+        if (gcount >= 2) {
+          dw[0] = (uint8_t) grp;
+          dcount = 1;
+          grp = 0;
+          gcount = 0;
+        }
+        
+      } else if (hex && (c == '>') && (!finished)) {
+        /* End of data marker, where a final odd digit is padded with a
+         * zero digit */
+        if (gcount > 0) {
+          dw[0] = (uint8_t) (grp << 4);
+          dcount = 1;
+          grp = 0;
+          gcount = 0;
+        }
+        finished = 1;
+        
+      } else if ((!hex) && (c == 'z') && (gcount == 0) && (!finished)) {
+        /* Shorthand for a zero dword */
+        memset(dw, 0, 4);
+        dcount = 4;
+        
+      } else if ((!hex) && (c >= '!') && (c <= 'u') && (!finished)) {
+        /* Base-85 digit */
+        grp = (grp * 85) + ((uint64_t) (c - '!'));
+        gcount++;
+        if (gcount >= 5) {
+          if (grp > UINT32_MAX) {
+            status = 0;
+          } else {
+            for(i = 0; i < 4; i++) {
+              dw[i] = (uint8_t) (grp >> (24 - (8 * i)));
+            }
+            dcount = 4;
+          }
+          grp = 0;
+          gcount = 0;
+        }
+        
+      } else if ((!hex) && (c == '~') && (!finished)) {
+        /* End of data marker, which must be followed by > */
+        if (getc(stdin) != '>') {
+          status = 0;
+        }
+        
+        /* Decode any final partial group by padding with the highest
+         * digit value */
+        if (status && (gcount > 0)) {
+          if (gcount < 2) {
+            status = 0;
+          }
+          if (status) {
+            for(i = gcount; i < 5; i++) {
+              grp = (grp * 85) + 84;
+            }
+            if (grp > UINT32_MAX) {
+              status = 0;
+            }
+          }
+          if (status) {
+            for(i = 0; i < 4; i++) {
+              dw[i] = (uint8_t) (grp >> (24 - (8 * i)));
+            }
+            dcount = gcount - 1;
+          }
+          grp = 0;
+          gcount = 0;
+        }
+        finished = 1;
+        
+      } else {
+        /* Invalid character, end of file, or data after end marker */
+        status = 0;
+      }
+      
+      /* If the end of data marker was reached without decoding anything
+       * and more data is needed, this is the end of a segment, and the
+       * next segment begins at an index point where decoding
+       * continues */
+      if (status && finished && (dcount < 1)) {
+        if ((pos % step != 0) || (pos / step >= ecount)) {
+          status = 0;
+        }
+        if (status) {
+          if (!seek_file(pIndex, INDEX_HEAD +
+                ((pos / step) * INDEX_ENTRY))) {
+            status = 0;
+          }
+        }
+        if (status) {
+          if (fread(ent, 1, INDEX_ENTRY, pIndex) != INDEX_ENTRY) {
+            status = 0;
+          }
+        }
+        if (status) {
+          if ((get_le(ent, 8) > (uint64_t) (INT64_MAX - base)) ||
+              (!seek_file(stdin, base + (int64_t) get_le(ent, 8)))) {
+            status = 0;
+          }
+        }
+        finished = 0;
+      }
+    }
+    
+    if (!status) {
+      fprintf(stderr, "%s: Encoded data is invalid or incomplete!\n",
+        pModule);
+      break;
+    }
+    
+    /* Write the decoded bytes that are within the range */
+    for(i = 0; i < dcount; i++) {
+      if ((pos >= offset) && (pos < end)) {
+        obuf[ocount] = dw[i];
+        ocount++;
+        if (ocount >= ENCODE_BUF) {
+          if (fwrite(obuf, 1, (size_t) ocount, stdout)
+                != (size_t) ocount) {
+            fprintf(stderr, "%s: I/O error writing to standard output!\n",
+              pModule);
+            abort();
+          }
+          ocount = 0;
+        }
+      }
+      pos++;
+    }
+  }
+  
+  /* Flush any remaining output */
+  if (status && (ocount > 0)) {
+    if (fwrite(obuf, 1, (size_t) ocount, stdout) != (size_t) ocount) {
+      fprintf(stderr, "%s: I/O error writing to standard output!\n",
+        pModule);
+      abort();
+    }
+  }
+  
+  /* Close the index file */
+  if (pIndex != NULL) {
+    fclose(pIndex);
+    pIndex = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Compute the SHA-256 digest of all data on standard input for the
+ * -dedup option, and make the data available again for encoding.
+ * 
+ * If standard input is a regular file, it is read once for the digest
+ * and then repositioned where it started, and ppIn receives stdin.
+ * Otherwise, the data is copied to a temporary file while the digest is
+ * computed, the temporary file is rewound, and ppIn receives the
+ * temporary file, which the caller must close.
+ * 
+ * The digest is computed with the checksum functions, so the caller
+ * must call sum_init() again afterwards before encoding.  pHex must
+ * have room for at least (2 * SHA256_DIGEST + 1) characters.
+ * 
+ * Parameters:
+ * 
+ *   ppIn - receives the file to encode from
+ * 
+ *   pHex - receives the digest in base-16
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int dedup_hash(FILE **ppIn, char *pHex) {
+  
+  static uint8_t buf[ENCODE_BUF];
+  
+  int status = 1;
+  int seekable = 0;
+  int64_t start = 0;
+  int64_t len = 0;
+  int32_t rcount = 0;
+  FILE *pSpool = NULL;
+  
+  /* Check parameters */
+  if ((ppIn == NULL) || (pHex == NULL)) {
+    abort();
+  }
+  *ppIn = NULL;
+  
+  /* Determine whether standard input can be read twice */
+#ifndef PSDATA_WIN
+  if (input_length(stdin, &len)) {
+    start = (int64_t) lseek(fileno(stdin), 0, SEEK_CUR);
+    if (start >= 0) {
+      seekable = 1;
+    }
+  }
+#endif
+  
+  /* If standard input can not be read twice, spool it */
+  if (!seekable) {
+    pSpool = tmpfile();
+    if (pSpool == NULL) {
+      status = 0;
+    }
+  }
+  
+  /* Hash all of the input, copying it to the spool if there is one */
+  sum_init(SUM_SHA256);
+  if (status) {
+    for(rcount = (int32_t) fread(buf, 1, ENCODE_BUF, stdin);
+        rcount > 0;
+        rcount = (int32_t) fread(buf, 1, ENCODE_BUF, stdin)) {
+      sum_update(buf, rcount);
+      if (pSpool != NULL) {
+        if (fwrite(buf, 1, (size_t) rcount, pSpool) != (size_t) rcount) {
+          status = 0;
+          break;
+        }
+      }
+    }
+    if (!feof(stdin)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    sum_hex(pHex);
+  }
+  
+  /* Make the data available again */
+  if (status && seekable) {
+    if (!seek_file(stdin, start)) {
+      status = 0;
+    }
+    
+  } else if (status) {
+    if (fflush(pSpool)) {
+      status = 0;
+    }
+    if (status) {
+      if (!seek_file(pSpool, 0)) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Return the file to encode from, or close the spool on error */
+  if (status) {
+    if (pSpool != NULL) {
+      *ppIn = pSpool;
+    } else {
+      *ppIn = stdin;
+    }
+  } else if (pSpool != NULL) {
+    fclose(pSpool);
+    pSpool = NULL;
+  }
+  
+  return status;
+}
+
+/*
+ * Look up a digest in the deduplication state file.
+ * 
+ * The state file is a text file with one line for each payload that
+ * has been defined in the document so far.  Each line has the base-16
+ * SHA-256 digest of the payload, a space, and the name it was defined
+ * with.  If the state file does not exist yet, it is treated as empty.
+ * 
+ * If the digest is found, pName receives the name it was defined with
+ * and pFound receives non-zero.  Otherwise, pName receives a new name
+ * made from pPrefix followed by one more than the number of lines in
+ * the state file, and pFound receives zero.  pName must have room for
+ * at least (MAX_NAME + 1) characters.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the state file
+ * 
+ *   pHex - the digest to look up
+ * 
+ *   pPrefix - the prefix for a new name
+ * 
+ *   pName - receives the name
+ * 
+ *   pFound - receives whether the digest was found
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the state file is not valid
+ */
+static int dedup_lookup(
+    const char *pPath,
+    const char *pHex,
+    const char *pPrefix,
+    char *pName,
+    int *pFound) {
+  
+  char line[MAX_STATE_LINE + 1];
+  int status = 1;
+  FILE *pState = NULL;
+  int64_t count = 0;
+  size_t hlen = 0;
+  size_t llen = 0;
+  
+  /* Initialize buffer */
+  memset(line, 0, sizeof(line));
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pHex == NULL) || (pPrefix == NULL) ||
+      (pName == NULL) || (pFound == NULL)) {
+    abort();
+  }
+  if (strlen(pPrefix) > MAX_PREFIX) {
+    abort();
+  }
+  *pFound = 0;
+  hlen = strlen(pHex);
+  
+  /* Open the state file if it exists */
+  pState = fopen(pPath, "rb");
+  
+  /* Read each line */
+  if (pState != NULL) {
+    while (fgets(line, sizeof(line), pState) != NULL) {
+      
+      /* Strip the line break, which must be present */
+      llen = strlen(line);
+      if ((llen < 1) || (line[llen - 1] != '\n')) {
+        status = 0;
+        break;
+      }
+      line[--llen] = (char) 0;
+      if ((llen > 0) && (line[llen - 1] == '\r')) {
+        line[--llen] = (char) 0;
+      }
+      
+      /* Check the format */
+      if ((llen <= hlen + 1) || (line[hlen] != ' ') ||
+          (!check_name(line + hlen + 1))) {
+        status = 0;
+        break;
+      }
+      count++;
+      
+      /* Check for a match */
+      if (memcmp(line, pHex, hlen) == 0) {
+        strcpy(pName, line + hlen + 1);
+        *pFound = 1;
+        break;
+      }
+    }
+    
+    if (status && (!(*pFound)) && ferror(pState)) {
+      status = 0;
+    }
+    
+    fclose(pState);
+    pState = NULL;
+  }
+  
+  /* Generate a new name if not found */
+  if (status && (!(*pFound))) {
+    sprintf(pName, "%s%lld", pPrefix, (long long) (count + 1));
+  }
+  
+  return status;
+}
+
+/*
+ * Append a digest and name to the deduplication state file.
+ * 
+ * See dedup_lookup() for the format of the state file.  The file is
+ * created if it does not exist yet.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path to the state file
+ * 
+ *   pHex - the digest
+ * 
+ *   pName - the name the payload was defined with
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int dedup_record(
+    const char *pPath,
+    const char *pHex,
+    const char *pName) {
+  
+  int status = 1;
+  FILE *pState = NULL;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pHex == NULL) || (pName == NULL)) {
+    abort();
+  }
+  
+  /* Append the line */
+  pState = fopen(pPath, "ab");
+  if (pState == NULL) {
+    status = 0;
+  }
+  
+  if (status) {
+    if (fprintf(pState, "%s %s\n", pHex, pName) < 1) {
+      status = 0;
+    }
+  }
+  
+  if (pState != NULL) {
+    if (fclose(pState)) {
+      status = 0;
+    }
+    pState = NULL;
+  }
+  
+  return status;
+}
+
+/*
+ * Compute the total number of lines that will be written with
+ * write_char() when encoding input of a given length with the "z" code
+ * disabled, or in base-16.
+ * 
+ * This mirrors the output written for one segment: the lines written
+ * before the encoded data, the encoded data with implicit line breaks,
+ * the end of stream marker, and the lines written after the end of
+ * stream marker.  The checksum comment is not included; see
+ * sum_lines().
+ * It may only be used when m_noz or m_hex is set, because otherwise the
+ * length of the encoded data depends on the input content.
+ * 
+ * Parameters:
+ * 
+ *   inlen - the number of input bytes
+ * 
+ *   pre - the number of lines written before the encoded data
+ * 
+ *   post - the number of lines written after the end of stream marker,
+ *   not including the checksum comment
+ * 
+ * Return:
+ * 
+ *   the predicted line count
+ */
+static int64_t predict_lines(int64_t inlen, int32_t pre, int32_t post) {
+  
+  int64_t lines = 0;
+  int64_t chars = 0;
+  
+  /* Check state and parameters */
+  if (((!m_noz) && (!m_hex)) || (inlen < 0) || (pre < 0) || (post < 0)) {
+    abort();
+  }
+  
+  /* Lines before and after the data */
+  lines = ((int64_t) pre) + ((int64_t) post);
+  
+  /* In base-16, each byte is two digits; in Base-85, each full dword is
+   * five digits, and a partial dword of n bytes is n + 1 digits */
+  if (m_hex) {
+    chars = inlen * 2;
+  } else {
+    chars = (inlen / 4) * 5;
+    if (inlen % 4 > 0) {
+      chars += (inlen % 4) + 1;
+    }
+  }
+  
+  /* An implicit line break occurs before each digit that would exceed
+   * the line length */
+  if (chars > 0) {
+    lines += (chars - 1) / m_line_len;
+  }
+  
+  /* The line break before the end of stream marker, and the line break
+   * after it */
+  lines += 2;
+  
+  return lines;
+}
+
+/*
+ * Compute the number of lines in the checksum comment.
+ * 
+ * The checksum comment is continued on a new line whenever it fills a
+ * line, and each line holds the leading percent sign and up to one less
+ * than the line length of comment text.
+ * 
+ * Return:
+ * 
+ *   the number of lines, or zero if no checksum is selected
+ */
+static int32_t sum_lines(void) {
+  
+  int32_t clen = 0;
+  
+  /* No lines if no checksum */
+  if (m_sum_type == SUM_NONE) {
+    return 0;
+  }
+  
+  /* Compute the length of the comment text */
+  clen = (int32_t) (strlen(SUM_PREFIX) + strlen(sum_name()) + 1);
+  if (m_sum_type == SUM_CRC32C) {
+    clen += 8;
+  } else {
+    clen += 2 * SHA256_DIGEST;
+  }
+  
+  return (clen + m_line_len - 2) / (m_line_len - 1);
+}
+
+/*
+ * Write a %%BeginData tag line directly to standard output.
+ * 
+ * Parameters:
+ * 
+ *   lines - the line count to declare
+ * 
+ * Return:
+ * 
+ *   the number of bytes written, including the line break
+ */
+static int32_t dsc_begin(int64_t lines) {
+  
+  int count = 0;
+  
+  /* Check parameter */
+  if ((lines < 0) || (lines > INT32_MAX)) {
+    abort();
+  }
+  
+  /* Write the tag */
+  count = printf("%%%%BeginData: %ld ASCII Lines", (long) lines);
+  if (count < 1) {
+    fprintf(stderr, "%s: I/O error writing to standard output!\n",
+      pModule);
+    abort();
+  }
+  line_break();
+  
+#ifdef PSDATA_WIN
+  return ((int32_t) count) + 2;
+#else
+  return ((int32_t) count) + 1;
+#endif
+}
+
+/*
+ * Write a %%EndData tag line directly to standard output.
+ * 
+ * Return:
+ * 
+ *   the number of bytes written, including the line break
+ */
+static int32_t dsc_end(void) {
+  
+  int count = 0;
+  
+  /* Write the tag */
+  count = printf("%%%%EndData");
+  if (count < 1) {
+    fprintf(stderr, "%s: I/O error writing to standard output!\n",
+      pModule);
+    abort();
+  }
+  line_break();
+  
+#ifdef PSDATA_WIN
+  return ((int32_t) count) + 2;
+#else
+  return ((int32_t) count) + 1;
+#endif
+}
+
+/*
+ * Begin a new segment of output.
+ * 
+ * The current segment is reset to start at the current output
+ * position.  In SEG_STREAM mode, any buffered output is flushed and the
+ * %%BeginData tag is written with the predicted line count of the
+ * segment.  Then, the segment text in m_seg_pre is written, if there is
+ * any.
+ */
+static void seg_open(void) {
+  
+  SEGMENT *ps = NULL;
+  int64_t k = 0;
+  int64_t slen = 0;
+  int last = 0;
+  
+  /* Initialize the new segment */
+  k = m_seg_count;
+  ps = &m_seg_cur;
+  m_seg_count++;
+  
+  memset(ps, 0, sizeof(SEGMENT));
+  ps->start_off = m_data_count;
+  ps->start_line = m_line_count;
+  
+  /* In streaming mode, predict the line count and write the tag */
+  if (m_seg_mode == SEG_STREAM) {
+    /* Determine the input length of this segment, and whether it is
+     * the last segment */
+    slen = m_seg_len;
+    last = 1;
+    if (m_seg_chunk > 0) {
+      if (k > m_seg_len / m_seg_chunk) {
+        slen = 0;
+      } else {
+        slen = m_seg_len - (k * m_seg_chunk);
+      }
+      if (slen > m_seg_chunk) {
+        slen = m_seg_chunk;
+        last = 0;
+      }
+    }
+    
+    /* Predict the line count */
+    if (last) {
+      ps->pred = predict_lines(slen, m_seg_pre_lines, m_seg_post_lines)
+                  + sum_lines();
+    } else {
+      ps->pred = predict_lines(slen, m_seg_pre_lines, 0);
+    }
+    
+    /* Flush output before writing the tag */
+    write_char(-1);
+    
+    m_seg_extra_off += dsc_begin(ps->pred);
+    m_seg_extra_line++;
+  }
+  
+  /* Write the segment text */
+  if (m_seg_pre != NULL) {
+    write_line(m_seg_pre);
+  }
+}
+
+/*
+ * Finish the current segment of output.
+ * 
+ * The end of stream marker and any text following it must already have
+ * been written.  The byte and line counts of the current segment are
+ * computed.  In SEG_SPOOL mode, the segment is then added to the
+ * segment table.  In SEG_STREAM mode, the predicted line count is
+ * checked, any buffered output is flushed, and the %%EndData tag is
+ * written.
+ */
+static void seg_close(void) {
+  
+  SEGMENT *ps = NULL;
+  
+  /* Check state */
+  if (m_seg_count < 1) {
+    abort();
+  }
+  
+  /* Record the counts */
+  ps = &m_seg_cur;
+  ps->bytes = m_data_count - ps->start_off;
+  ps->lines = m_line_count - ps->start_line;
+  
+  /* In spooling mode, add the segment to the table, growing it if
+   * necessary */
+  if (m_seg_mode == SEG_SPOOL) {
+    if (m_seg_count > m_seg_cap) {
+      if (m_seg_cap < 1) {
+        m_seg_cap = 16;
+      } else if (m_seg_cap <=
+                  INT64_MAX / (2 * (int64_t) sizeof(SEGMENT))) {
+        m_seg_cap *= 2;
+      } else {
+        fprintf(stderr, "%s: Segment counter overflow!\n", pModule);
+        abort();
+      }
+      
+      m_seg = (SEGMENT *) realloc(m_seg,
+                            ((size_t) m_seg_cap) * sizeof(SEGMENT));
+      if (m_seg == NULL) {
+        abort();
+      }
+    }
+    
+    memcpy(&(m_seg[m_seg_count - 1]), ps, sizeof(SEGMENT));
+  }
+  
+  /* In streaming mode, the predicted line count must have been exact,
+   * and then the tag is written */
+  if (m_seg_mode == SEG_STREAM) {
+    if (ps->lines != ps->pred) {
+      abort();
+    }
+    
+    write_char(-1);
+    m_seg_extra_off += dsc_end();
+    m_seg_extra_line++;
+  }
+}
+
+/*
+ * Handle a segment boundary in the input.
+ * 
+ * The current segment is ended with an end of stream marker and
+ * closed, and then a new segment is opened.
+ */
+static void seg_break(void) {
+  
+  /* Check state */
+  if ((m_seg_chunk < 1) || (m_in_count != m_seg_next)) {
+    abort();
+  }
+  
+  /* Write the end of stream marker */
+  write_eod();
+  
+  /* Close the current segment and open the next one */
+  seg_close();
+  seg_open();
+  
+  /* Advance to the next segment boundary */
+  if (m_seg_next <= INT64_MAX - m_seg_chunk) {
+    m_seg_next += m_seg_chunk;
+  } else {
+    m_seg_next = -1;
+  }
+}
+
+/*
+ * Copy a string of space-separated tokens, replacing spaces with line
+ * breaks where necessary to keep each line within m_line_len.
+ * 
+ * pSrc must not begin or end with a space, nor have consecutive
+ * spaces.  pDst must have room for at least (strlen(pSrc) + 1)
+ * characters.
+ * 
+ * Parameters:
+ * 
+ *   pSrc - the tokens to wrap
+ * 
+ *   pDst - buffer to receive the wrapped tokens
+ * 
+ * Return:
+ * 
+ *   the number of lines, or zero if a single token is longer than the
+ *   line length
+ */
+static int32_t wrap_tokens(const char *pSrc, char *pDst) {
+  
+  int32_t lines = 1;
+  int32_t lpos = 0;
+  int32_t tlen = 0;
+  
+  /* Check parameters */
+  if ((pSrc == NULL) || (pDst == NULL)) {
+    abort();
+  }
+  
+  /* Copy each token */
+  while (*pSrc != 0) {
+    /* Measure the token */
+    for(tlen = 0; (pSrc[tlen] != 0) && (pSrc[tlen] != ' '); tlen++);
+    if (tlen > m_line_len) {
+      return 0;
+    }
+    
+    /* Separate from the previous token with a space if it fits on the
+     * line, otherwise with a line break */
+    if (lpos > 0) {
+      if (lpos + 1 + tlen <= m_line_len) {
+        *pDst = ' ';
+        lpos++;
+      } else {
+        *pDst = '\n';
+        lines++;
+        lpos = 0;
+      }
+      pDst++;
+    }
+    
+    /* Copy the token */
+    memcpy(pDst, pSrc, (size_t) tlen);
+    pDst += tlen;
+    pSrc += tlen;
+    lpos += tlen;
+    
+    /* Skip the separating space */
+    if (*pSrc == ' ') {
+      pSrc++;
+    }
+  }
+  *pDst = (char) 0;
+  
+  return lines;
+}
+
+/*
+ * Build the text that wraps the encoded data as a named reusable
+ * stream.
+ * 
+ * The definition text is written in place of the header line, and
+ * creates a ReusableStreamDecode filter that reads the encoded data
+ * from currentfile, optionally through an intermediate pFilter filter:
+ * 
+ *   currentglobal true setglobal globaldict /name currentfile
+ *     /ASCII85Decode filter /pFilter filter /ReusableStreamDecode filter
+ * 
+ * If m_hex is set, /ASCIIHexDecode is used instead of /ASCII85Decode.
+ * 
+ * The interpreter decodes all the data up to the end of stream marker
+ * when it creates the ReusableStreamDecode filter, so the operators
+ * that bind the filter to pName can not be part of the definition text.
+ * Instead, they are in the end text, which must be written right after
+ * the end of stream marker:
+ * 
+ *   put setglobal
+ * 
+ * The filters are allocated in global VM and the name is stored in
+ * globaldict, so that the definition is not undone by the restore at
+ * the end of a page.  Later references to the name do not need to
+ * decode the data again.
+ * 
+ * The use text is only built if pHead is not NULL.  It is written after
+ * the end text, and repositions the stream at the start before running
+ * the header line as the consuming operator:
+ * 
+ *   name dup 0 setfileposition
+ *   pHead
+ * 
+ * All texts are wrapped at token boundaries with wrap_tokens() so that
+ * they fit within m_line_len, except for the header line, which is
+ * always on a line by itself and must already fit.
+ * 
+ * pDef, pEnd, and pUse must have room for at least MAX_REUSE
+ * characters.  If pHead is NULL, pUse receives an empty string and zero
+ * use lines.
+ * 
+ * Parameters:
+ * 
+ *   pName - the name to define
+ * 
+ *   pFilter - the intermediate filter name, or NULL
+ * 
+ *   pHead - the consuming operator, or NULL
+ * 
+ *   pDef - buffer to receive the definition text
+ * 
+ *   pEnd - buffer to receive the end text
+ * 
+ *   pUse - buffer to receive the use text
+ * 
+ *   pDefLines - receives the number of lines in the definition text
+ * 
+ *   pEndLines - receives the number of lines in the end text
+ * 
+ *   pUseLines - receives the number of lines in the use text
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if a token is longer than the line
+ *   length
+ */
+static int reuse_lines(
+    const char *pName,
+    const char *pFilter,
+    const char *pHead,
+    char *pDef,
+    char *pEnd,
+    char *pUse,
+    int32_t *pDefLines,
+    int32_t *pEndLines,
+    int32_t *pUseLines) {
+  
+  char buf[MAX_REUSE];
+  
+  /* Initialize buffer */
+  memset(buf, 0, MAX_REUSE);
+  
+  /* Check parameters */
+  if ((pName == NULL) || (pDef == NULL) || (pEnd == NULL) ||
+      (pUse == NULL) || (pDefLines == NULL) || (pEndLines == NULL) ||
+      (pUseLines == NULL)) {
+    abort();
+  }
+  if ((strlen(pName) > MAX_NAME) ||
+      ((pFilter != NULL) && (strlen(pFilter) > MAX_NAME))) {
+    abort();
+  }
+  
+  /* Build and wrap the definition text */
+  strcpy(buf, "currentglobal true setglobal globaldict /");
+  strcat(buf, pName);
+  if (m_hex) {
+    strcat(buf, " currentfile /ASCIIHexDecode filter ");
+  } else {
+    strcat(buf, " currentfile /ASCII85Decode filter ");
+  }
+  if (pFilter != NULL) {
+    strcat(buf, "/");
+    strcat(buf, pFilter);
+    strcat(buf, " filter ");
+  }
+  strcat(buf, "/ReusableStreamDecode filter");
+  
+  *pDefLines = wrap_tokens(buf, pDef);
+  if (*pDefLines < 1) {
+    return 0;
+  }
+  
+  /* Build and wrap the end text */
+  *pEndLines = wrap_tokens("put setglobal", pEnd);
+  if (*pEndLines < 1) {
+    return 0;
+  }
+  
+  /* Build and wrap the use text */
+  pUse[0] = (char) 0;
+  *pUseLines = 0;
+  if (pHead != NULL) {
+    strcpy(buf, pName);
+    strcat(buf, " dup 0 setfileposition");
+    
+    *pUseLines = wrap_tokens(buf, pUse);
+    if (*pUseLines < 1) {
+      return 0;
+    }
+    
+    strcat(pUse, "\n");
+    strcat(pUse, pHead);
+    (*pUseLines)++;
+  }
+  
+  return 1;
+}
+
+/*
+ * Write lines of text to output with write_char(), followed by a line
+ * break.
+ * 
+ * The text may only contain characters in range [0x20, 0x7e] and line
+ * breaks, and each line must fit within the maximum line length.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the text to write
+ */
+static void write_line(const char *pstr) {
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Write the line */
+  for( ; *pstr != 0; pstr++) {
+    write_char(*pstr);
+  }
+  write_char('\n');
+}
+
+/*
+ * Check whether the given parameter is a valid header string.
+ * 
+ * In order to pass the check, the given string must:
+ * 
+ *   1) Have no more than MAX_PSLINE characters.
+ *   2) Contain only characters in range [0x20, 0x7e].
+ * 
+ * A fault occurs if NULL is passed.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the header string to check
+ * 
+ * Return:
+ * 
+ *   non-zero if header is OK, zero if not
+ */
+static int check_head(const char *pstr) {
+  
+  int result = 1;
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Verify length constraint */
+  if (strlen(pstr) > MAX_PSLINE) {
+    result = 0;
+  }
+  
+  /* Verify character constraint */
+  if (result) {
+    for( ; *pstr != 0; pstr++) {
+      if ((*pstr < 0x20) || (*pstr > 0x7e)) {
+        result = 0;
+        break;
+      }
     }
-    
-    /* Output with padding and reset accumulator */
-    encode_dword(eax, (int) pcount);
-    eax = 0;
-    cx = 0;
   }
   
-  /* Return status */
-  return status;
+  /* Return result */
+  return result;
 }
 
 /*
- * Check whether the given parameter is a valid header string.
+ * Check whether the given parameter is a valid PostScript name for the
+ * -reuse and -filter options.
  * 
  * In order to pass the check, the given string must:
  * 
- *   1) Have no more than MAX_PSLINE characters.
- *   2) Contain only characters in range [0x20, 0x7e].
+ *   1) Have at least one and no more than MAX_NAME characters.
+ *   2) Contain only ASCII letters, digits, underscore, hyphen, and
+ *      period.
+ *   3) Begin with a letter or underscore, so that it can not be
+ *      mistaken for a number.
  * 
  * A fault occurs if NULL is passed.
  * 
  * Parameters:
  * 
- *   pstr - the header string to check
+ *   pstr - the name to check
  * 
  * Return:
  * 
- *   non-zero if header is OK, zero if not
+ *   non-zero if name is OK, zero if not
  */
-static int check_head(const char *pstr) {
+static int check_name(const char *pstr) {
   
   int result = 1;
+  int c = 0;
   
   /* Check parameter */
   if (pstr == NULL) {
@@ -486,14 +4046,26 @@ static int check_head(const char *pstr) {
   }
   
   /* Verify length constraint */
-  if (strlen(pstr) > MAX_PSLINE) {
+  if ((strlen(pstr) < 1) || (strlen(pstr) > MAX_NAME)) {
     result = 0;
   }
   
+  /* Verify first character constraint */
+  if (result) {
+    c = *pstr;
+    if (!(((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z')) ||
+          (c == '_'))) {
+      result = 0;
+    }
+  }
+  
   /* Verify character constraint */
   if (result) {
     for( ; *pstr != 0; pstr++) {
-      if ((*pstr < 0x20) || (*pstr > 0x7e)) {
+      c = *pstr;
+      if (!(((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z')) ||
+            ((c >= '0') && (c <= '9')) ||
+            (c == '_') || (c == '-') || (c == '.'))) {
         result = 0;
         break;
       }
@@ -607,6 +4179,104 @@ static int parseInt(const char *pstr, int32_t *pv) {
   return status;
 }
 
+/*
+ * Parse the given string as a signed 64-bit integer.
+ * 
+ * This is the same as parseInt(), except that the range of the result
+ * is 64-bit.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to parse
+ * 
+ *   pv - pointer to the return numeric value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int parseLong(const char *pstr, int64_t *pv) {
+  
+  int negflag = 0;
+  int64_t result = 0;
+  int status = 1;
+  int64_t d = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* If first character is a sign character, set negflag appropriately
+   * and skip it */
+  if (*pstr == '+') {
+    negflag = 0;
+    pstr++;
+  } else if (*pstr == '-') {
+    negflag = 1;
+    pstr++;
+  } else {
+    negflag = 0;
+  }
+  
+  /* Make sure we have at least one digit */
+  if (*pstr == 0) {
+    status = 0;
+  }
+  
+  /* Parse all digits */
+  if (status) {
+    for( ; *pstr != 0; pstr++) {
+    
+      /* Make sure in range of digits */
+      if ((*pstr < '0') || (*pstr > '9')) {
+        status = 0;
+      }
+    
+      /* Get numeric value of digit */
+      if (status) {
+        d = (int64_t) (*pstr - '0');
+      }
+      
+      /* Multiply result by 10, watching for overflow */
+      if (status) {
+        if (result <= INT64_MAX / 10) {
+          result = result * 10;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Add in digit value, watching for overflow */
+      if (status) {
+        if (result <= INT64_MAX - d) {
+          result = result + d;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+    
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Invert result if negative mode */
+  if (status && negflag) {
+    result = -(result);
+  }
+  
+  /* Write result if successful */
+  if (status) {
+    *pv = result;
+  }
+  
+  /* Return status */
+  return status;
+}
+
 /*
  * Program entrypoint
  * ==================
@@ -619,14 +4289,62 @@ int main(int argc, char *argv[]) {
   
   int32_t line_len = DEFAULT_LINE;
   int flag_dsc = 0;
+  int flag_sumerr = 0;
+  int sum_type = SUM_NONE;
   const char *pHead = NULL;
+  const char *pIndexPath = NULL;
+  int32_t index_step = DEFAULT_STEP;
+  int flag_step = 0;
+  int flag_extract = 0;
+  int64_t extract_off = 0;
+  int64_t extract_len = 0;
+  int64_t extract_base = 0;
+  int flag_base = 0;
+  int flag_noz = 0;
+  int flag_hex = 0;
+  int flag_inlen = 0;
+  int flag_known = 0;
+  int flag_stream = 0;
+  int64_t in_len = 0;
+  const char *pReuse = NULL;
+  const char *pFilter = NULL;
+  const char *pPre = NULL;
+  const char *pPost = NULL;
+  char def_line[MAX_REUSE];
+  char end_line[MAX_REUSE];
+  char use_line[MAX_REUSE];
+  char post_line[2 * MAX_REUSE];
+  int32_t end_lines = 0;
+  int32_t use_lines = 0;
+  int32_t pre_lines = 0;
+  int32_t post_lines = 0;
+  const char *pDedup = NULL;
+  int flag_found = 0;
+  char dedup_hex[2 * SHA256_DIGEST + 1];
+  char dedup_name[MAX_NAME + 1];
+  static uint8_t dedup_buf[ENCODE_BUF];
+  FILE *pIn = stdin;
+  FILE *pSpool = NULL;
+  
+  uint8_t index_head[INDEX_HEAD];
+  int64_t chunk = 0;
+  int64_t si = 0;
   
   FILE *pTemp = NULL;
   char *pbuf = NULL;
-  const char *pc = NULL;
-  int32_t tcount = 0;
+  int64_t tcount = 0;
+  int64_t tend = 0;
   int32_t tlen = 0;
   
+  /* Initialize buffers */
+  memset(index_head, 0, INDEX_HEAD);
+  memset(def_line, 0, sizeof(def_line));
+  memset(end_line, 0, sizeof(end_line));
+  memset(use_line, 0, sizeof(use_line));
+  memset(post_line, 0, sizeof(post_line));
+  memset(dedup_hex, 0, sizeof(dedup_hex));
+  memset(dedup_name, 0, sizeof(dedup_name));
+  
   /* Get program name */
   pModule = NULL;
   if ((argc > 0) && (argv != NULL)) {
@@ -676,11 +4394,214 @@ int main(int argc, char *argv[]) {
         /* Set Document Structuring Conventions mode flag */
         flag_dsc = 1;
         
-      } else if (strcmp(argv[i], "-head") == 0) {
-        /* Header option requires an additional parameter */
+      } else if (strcmp(argv[i], "-head") == 0) {
+        /* Header option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -head option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Check that parameter is valid header line */
+        if (status) {
+          if (!check_head(argv[i])) {
+            status = 0;
+            fprintf(stderr, "%s: -head option value is not valid!\n",
+              pModule);
+          }
+        }
+        
+        /* Store the header line */
+        if (status) {
+          pHead = argv[i];
+        }
+        
+      } else if (strcmp(argv[i], "-len") == 0) {
+        /* Length option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -len option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Set the line length */
+        if (status) {
+          if (!parseInt(argv[i], &line_len)) {
+            status = 0;
+            fprintf(stderr, "%s: -len option value is not valid!\n",
+              pModule);
+          }
+        }
+        
+        /* Check the line length setting */
+        if (status) {
+          if ((line_len < MIN_LINE) || (line_len > MAX_PSLINE)) {
+            status = 0;
+            fprintf(stderr, "%s: -len option value out of range!\n",
+              pModule);
+          }
+        }
+        
+      } else if (strcmp(argv[i], "-sum") == 0) {
+        /* Checksum option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -sum option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Select the checksum algorithm */
+        if (status) {
+          if (strcmp(argv[i], "crc32c") == 0) {
+            sum_type = SUM_CRC32C;
+          } else if (strcmp(argv[i], "sha256") == 0) {
+            sum_type = SUM_SHA256;
+          } else {
+            status = 0;
+            fprintf(stderr, "%s: -sum option value is not valid!\n",
+              pModule);
+          }
+        }
+        
+      } else if (strcmp(argv[i], "-index") == 0) {
+        /* Index option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -index option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Store the index file path */
+        if (status) {
+          pIndexPath = argv[i];
+        }
+        
+      } else if (strcmp(argv[i], "-step") == 0) {
+        /* Step option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -step option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Set the index step */
+        if (status) {
+          if (!parseInt(argv[i], &index_step)) {
+            status = 0;
+            fprintf(stderr, "%s: -step option value is not valid!\n",
+              pModule);
+          }
+        }
+        
+        /* Index entries must fall on dword boundaries */
+        if (status) {
+          if ((index_step < 4) || (index_step % 4 != 0)) {
+            status = 0;
+            fprintf(stderr, "%s: -step option value out of range!\n",
+              pModule);
+          }
+        }
+        
+        if (status) {
+          flag_step = 1;
+        }
+        
+      } else if (strcmp(argv[i], "-extract") == 0) {
+        /* Extract option requires two additional parameters */
+        if (i >= argc - 2) {
+          status = 0;
+          fprintf(stderr, "%s: -extract option requires two parameters!\n",
+            pModule);
+        }
+        
+        /* Parse the offset and length */
+        if (status) {
+          if ((!parseLong(argv[i + 1], &extract_off)) ||
+              (!parseLong(argv[i + 2], &extract_len))) {
+            status = 0;
+            fprintf(stderr, "%s: -extract option value is not valid!\n",
+              pModule);
+          }
+        }
+        
+        if (status) {
+          if ((extract_off < 0) || (extract_len < 0)) {
+            status = 0;
+            fprintf(stderr, "%s: -extract option value out of range!\n",
+              pModule);
+          }
+        }
+        
+        /* We also consumed the next two parameters */
+        if (status) {
+          i += 2;
+          flag_extract = 1;
+        }
+        
+      } else if (strcmp(argv[i], "-base") == 0) {
+        /* Base option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -base option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Set the offset of the output within standard input */
+        if (status) {
+          if (!parseLong(argv[i], &extract_base)) {
+            status = 0;
+            fprintf(stderr, "%s: -base option value is not valid!\n",
+              pModule);
+          }
+        }
+        
+        if (status) {
+          if (extract_base < 0) {
+            status = 0;
+            fprintf(stderr, "%s: -base option value out of range!\n",
+              pModule);
+          }
+        }
+        
+        if (status) {
+          flag_base = 1;
+        }
+        
+      } else if (strcmp(argv[i], "-chunk") == 0) {
+        /* Chunk option requires an additional parameter */
         if (i >= argc - 1) {
           status = 0;
-          fprintf(stderr, "%s: -head option requires a parameter!\n",
+          fprintf(stderr, "%s: -chunk option requires a parameter!\n",
             pModule);
         }
         
@@ -689,25 +4610,37 @@ int main(int argc, char *argv[]) {
           i++;
         }
         
-        /* Check that parameter is valid header line */
+        /* Set the segment size */
         if (status) {
-          if (!check_head(argv[i])) {
+          if (!parseLong(argv[i], &chunk)) {
             status = 0;
-            fprintf(stderr, "%s: -head option value is not valid!\n",
+            fprintf(stderr, "%s: -chunk option value is not valid!\n",
               pModule);
           }
         }
         
-        /* Store the header line */
+        /* Segments must end on dword boundaries */
         if (status) {
-          pHead = argv[i];
+          if ((chunk < 4) || (chunk % 4 != 0)) {
+            status = 0;
+            fprintf(stderr, "%s: -chunk option value out of range!\n",
+              pModule);
+          }
         }
         
-      } else if (strcmp(argv[i], "-len") == 0) {
-        /* Length option requires an additional parameter */
+      } else if (strcmp(argv[i], "-noz") == 0) {
+        /* Set flag to disable the "z" code */
+        flag_noz = 1;
+        
+      } else if (strcmp(argv[i], "-hex") == 0) {
+        /* Set flag to encode in base-16 instead of Base-85 */
+        flag_hex = 1;
+        
+      } else if (strcmp(argv[i], "-inlen") == 0) {
+        /* Input length option requires an additional parameter */
         if (i >= argc - 1) {
           status = 0;
-          fprintf(stderr, "%s: -len option requires a parameter!\n",
+          fprintf(stderr, "%s: -inlen option requires a parameter!\n",
             pModule);
         }
         
@@ -716,24 +4649,81 @@ int main(int argc, char *argv[]) {
           i++;
         }
         
-        /* Set the line length */
+        /* Set the declared input length */
         if (status) {
-          if (!parseInt(argv[i], &line_len)) {
+          if (!parseLong(argv[i], &in_len)) {
             status = 0;
-            fprintf(stderr, "%s: -len option value is not valid!\n",
+            fprintf(stderr, "%s: -inlen option value is not valid!\n",
               pModule);
           }
         }
         
-        /* Check the line length setting */
         if (status) {
-          if ((line_len < MIN_LINE) || (line_len > MAX_PSLINE)) {
+          if (in_len < 0) {
             status = 0;
-            fprintf(stderr, "%s: -len option value out of range!\n",
+            fprintf(stderr, "%s: -inlen option value out of range!\n",
               pModule);
           }
         }
         
+        if (status) {
+          flag_inlen = 1;
+        }
+        
+      } else if ((strcmp(argv[i], "-reuse") == 0) ||
+                  (strcmp(argv[i], "-filter") == 0)) {
+        /* Name options require an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: %s option requires a parameter!\n",
+            pModule, argv[i]);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Check that parameter is valid name */
+        if (status) {
+          if (!check_name(argv[i])) {
+            status = 0;
+            fprintf(stderr, "%s: %s option value is not valid!\n",
+              pModule, argv[i - 1]);
+          }
+        }
+        
+        /* Store the name */
+        if (status) {
+          if (strcmp(argv[i - 1], "-reuse") == 0) {
+            pReuse = argv[i];
+          } else {
+            pFilter = argv[i];
+          }
+        }
+        
+      } else if (strcmp(argv[i], "-dedup") == 0) {
+        /* Deduplication option requires an additional parameter */
+        if (i >= argc - 1) {
+          status = 0;
+          fprintf(stderr, "%s: -dedup option requires a parameter!\n",
+            pModule);
+        }
+        
+        /* We will also consume the next parameter */
+        if (status) {
+          i++;
+        }
+        
+        /* Store the state file path */
+        if (status) {
+          pDedup = argv[i];
+        }
+        
+      } else if (strcmp(argv[i], "-sumerr") == 0) {
+        /* Set flag to also report checksum on standard error */
+        flag_sumerr = 1;
+        
       } else {
         /* Unrecognized option */
         status = 0;
@@ -758,16 +4748,265 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* Set up the line control data */
+  /* The -step and -extract options require an index file */
+  if (status && (flag_step || flag_extract) && (pIndexPath == NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: -step and -extract options require -index!\n",
+      pModule);
+  }
+  
+  /* The -base option only applies to extract mode */
+  if (status && flag_base && (!flag_extract)) {
+    status = 0;
+    fprintf(stderr, "%s: -base option requires -extract!\n", pModule);
+  }
+  
+  /* In extract mode, decode the requested range and skip everything
+   * else, since no encoding takes place */
+  if (status && flag_extract) {
+    if (!extract_input(pIndexPath, extract_off, extract_len,
+          extract_base)) {
+      status = 0;
+    }
+    if (status) {
+      if (fflush(stdout)) {
+        status = 0;
+        fprintf(stderr, "%s: I/O error writing to standard output!\n",
+          pModule);
+      }
+    }
+    if (status) {
+      return 0;
+    } else {
+      return 1;
+    }
+  }
+  
+  /* The -sumerr option requires a checksum to be selected */
+  if (status && flag_sumerr && (sum_type == SUM_NONE)) {
+    status = 0;
+    fprintf(stderr, "%s: -sumerr option requires -sum option!\n",
+      pModule);
+  }
+  
+  /* A reusable stream can only be defined once, so it can not be
+   * divided into segments */
+  if (status && (chunk > 0) && (pReuse != NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: -chunk option can not be used with -reuse!\n",
+      pModule);
+  }
+  
+  /* When segments are indexed, each segment must begin at an index
+   * point so that extraction can continue into the next segment */
+  if (status && (chunk > 0) && (pIndexPath != NULL)) {
+    if (chunk % index_step != 0) {
+      status = 0;
+      fprintf(stderr, "%s: -chunk value must be a multiple of -step!\n",
+        pModule);
+    }
+  }
+  
+  /* Deduplication references payloads with the header line as the
+   * consuming operator, and a reference can not be indexed or divided
+   * into segments */
+  if (status && (pDedup != NULL)) {
+    if (pHead == NULL) {
+      status = 0;
+      fprintf(stderr, "%s: -dedup option requires -head option!\n",
+        pModule);
+    
+    } else if ((pIndexPath != NULL) || (chunk > 0)) {
+      status = 0;
+      fprintf(stderr, "%s: -dedup option can not be used with -index "
+        "or -chunk!\n", pModule);
+    
+    } else if ((pReuse != NULL) && (strlen(pReuse) > MAX_PREFIX)) {
+      status = 0;
+      fprintf(stderr, "%s: -reuse prefix is too long for -dedup!\n",
+        pModule);
+    }
+  }
+  
+  /* The -filter option requires a reusable stream */
+  if (status && (pFilter != NULL) && (pReuse == NULL) &&
+      (pDedup == NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: -filter option requires -reuse option!\n",
+      pModule);
+  }
+  
+  /* In deduplication mode, hash the input and look it up in the state
+   * file, and then define the payload as a reusable stream with the
+   * name from the state file, using any -reuse name as the prefix for
+   * new names */
+  if (status && (pDedup != NULL)) {
+    if (!dedup_hash(&pIn, dedup_hex)) {
+      status = 0;
+      fprintf(stderr, "%s: Failed to read input for deduplication!\n",
+        pModule);
+    }
+    if (status) {
+      if (pIn != stdin) {
+        pSpool = pIn;
+      }
+    }
+    
+    if (status) {
+      if (!dedup_lookup(pDedup, dedup_hex,
+            (pReuse != NULL) ? pReuse : DEFAULT_PREFIX,
+            dedup_name, &flag_found)) {
+        status = 0;
+        fprintf(stderr, "%s: Deduplication state file is not valid!\n",
+          pModule);
+      }
+    }
+    
+    if (status) {
+      pReuse = dedup_name;
+    }
+  }
+  
+  /* Set up the line control data and the encoding, which the reusable
+   * stream definition depends on */
   if (status) {
     m_line_len = line_len;
     m_line_pos = 0;
+    m_hex = flag_hex;
+  }
+  
+  /* Determine the lines written before the data and after the end of
+   * stream marker, which for a reusable stream are the definition lines
+   * before, and the end lines followed by the use lines after, and
+   * otherwise just the header line */
+  if (status && (pReuse != NULL)) {
+    if (!reuse_lines(pReuse, pFilter, pHead, def_line, end_line,
+          use_line, &pre_lines, &end_lines, &use_lines)) {
+      status = 0;
+      fprintf(stderr, "%s: Reusable stream token is longer than line "
+        "length!\n", pModule);
+    }
+    if (status) {
+      strcpy(post_line, end_line);
+      if (use_lines > 0) {
+        strcat(post_line, "\n");
+        strcat(post_line, use_line);
+      }
+      pPre = def_line;
+      pPost = post_line;
+      post_lines = end_lines + use_lines;
+    }
+    
+  } else if (status && (pHead != NULL)) {
+    pPre = pHead;
+    pre_lines = 1;
+  }
+  
+  /* If this payload was already defined in the document, just write the
+   * use lines to reference it and skip everything else, since nothing
+   * needs to be encoded -- except that a requested checksum is still
+   * computed over the input and written after the use lines */
+  if (status && flag_found) {
+    m_out = stdout;
+    write_line(use_line);
+    
+    if (sum_type != SUM_NONE) {
+      sum_init(sum_type);
+      for(tlen = (int32_t) fread(dedup_buf, 1, ENCODE_BUF, pIn);
+          tlen > 0;
+          tlen = (int32_t) fread(dedup_buf, 1, ENCODE_BUF, pIn)) {
+        sum_update(dedup_buf, tlen);
+      }
+      if (!feof(pIn)) {
+        status = 0;
+        fprintf(stderr, "%s: Failed to read input for checksum!\n",
+          pModule);
+      }
+      if (status) {
+        write_sum(flag_sumerr);
+      }
+    }
+    
+    write_char(-1);
+    if (fflush(stdout)) {
+      status = 0;
+      fprintf(stderr, "%s: I/O error writing to standard output!\n",
+        pModule);
+    }
+    if (pSpool != NULL) {
+      fclose(pSpool);
+      pSpool = NULL;
+    }
+    if (status) {
+      return 0;
+    } else {
+      return 1;
+    }
+  }
+  
+  /* Set up the input checksum */
+  if (status) {
+    sum_init(sum_type);
+  }
+  
+  /* Set up the "z" code setting */
+  if (status) {
+    m_noz = flag_noz;
+  }
+  
+  /* If the input length was not declared, determine it from standard
+   * input if possible */
+  if (status) {
+    if (flag_inlen) {
+      flag_known = 1;
+    } else if (input_length(pIn, &in_len)) {
+      flag_known = 1;
+    }
+  }
+  
+  /* In DSC mode, if the "z" code is disabled or base-16 is used, and
+   * the input length is known, the line count can be predicted so the
+   * output can be streamed without buffering it in a temporary file */
+  if (status && flag_dsc && (flag_noz || flag_hex) && flag_known) {
+    if (predict_lines(in_len, pre_lines, post_lines) + sum_lines()
+          > INT32_MAX) {
+      status = 0;
+      fprintf(stderr, "%s: Line counter overflow!\n", pModule);
+    }
+    if (status) {
+      flag_stream = 1;
+    }
+  }
+  
+  /* If an index was requested, create the index file, leaving room for
+   * the header which is written at the end */
+  if (status && (pIndexPath != NULL)) {
+    m_index = fopen(pIndexPath, "w+b");
+    if (m_index == NULL) {
+      status = 0;
+      fprintf(stderr, "%s: Failed to create index file!\n", pModule);
+    }
+    
+    if (status) {
+      if (fwrite(index_head, 1, INDEX_HEAD, m_index) != INDEX_HEAD) {
+        status = 0;
+        fprintf(stderr, "%s: I/O error writing to index file!\n",
+          pModule);
+      }
+    }
+    
+    if (status) {
+      m_index_step = index_step;
+      m_index_next = 0;
+      m_index_count = 0;
+    }
   }
   
-  /* If we are in DSC mode, we will need to buffer all output into a
-   * temporary file, so create that file here and set it as the output
-   * target; otherwise, just set the output target directly to stdout */
-  if (status && flag_dsc) {
+  /* If we are in DSC mode and not streaming, we will need to buffer all
+   * output into a temporary file, so create that file here and set it
+   * as the output target; otherwise, just set the output target
+   * directly to stdout */
+  if (status && flag_dsc && (!flag_stream)) {
     /* DSC mode, so open a temporary file and direct output to that
      * temporary file */
     pTemp = tmpfile();
@@ -779,60 +5018,106 @@ int main(int argc, char *argv[]) {
     
     if (status) {
       m_out = pTemp;
+      if (flag_known) {
+        PSDATA_PROBE(spool_start, in_len);
+      } else {
+        PSDATA_PROBE(spool_start, -1);
+      }
     }
     
   } else if (status) {
-    /* Not in DSC mode, so output directly to stdout */
+    /* Not in DSC mode or streaming, so output directly to stdout */
     m_out = stdout;
   }
   
-  /* We can't do any DSC header until we've buffered all the encoded
-   * output and counted the total number of lines, so we will ignore the
-   * DSC flag until later -- begin by writing the header line followed
-   * by a line break, if a header line was defined */
-  if (status && (pHead != NULL)) {
-    for(pc = pHead; *pc != 0; pc++) {
-      write_char(*pc);
+  /* Set up the segments */
+  if (status) {
+    if (!flag_dsc) {
+      m_seg_mode = SEG_PLAIN;
+    } else if (flag_stream) {
+      m_seg_mode = SEG_STREAM;
+    } else {
+      m_seg_mode = SEG_SPOOL;
     }
-    write_char('\n');
+    
+    m_seg_chunk = chunk;
+    if (chunk > 0) {
+      m_seg_next = chunk;
+    } else {
+      m_seg_next = -1;
+    }
+    
+    m_seg_pre = pPre;
+    m_seg_pre_lines = pre_lines;
+    m_seg_post_lines = post_lines;
+    m_seg_len = in_len;
+  }
+  
+  /* Open the first segment -- unless we are streaming, we can't do any
+   * DSC header until we've buffered all the encoded output and counted
+   * the total number of lines, so this just writes the header line
+   * followed by a line break, if a header line was defined, or the
+   * definition of a reusable stream */
+  if (status) {
+    seg_open();
   }
   
   /* Encode all the data from standard input */
   if (status) {
-    if (!encode_input()) {
+    if (!encode_input(pIn)) {
       status = 0;
       fprintf(stderr, "%s: Encoding failed while reading!\n",
         pModule);
     }
   }
   
+  /* If the input length was declared, or the output is being streamed
+   * based on the input length, check that the actual input matched
+   * it */
+  if (status && (flag_inlen || flag_stream) && (m_in_count != in_len)) {
+    status = 0;
+    fprintf(stderr, "%s: Input length %lld does not match expected "
+      "length %lld!\n", pModule, (long long) m_in_count,
+      (long long) in_len);
+  }
+  
   /* Write the end of stream marker */
   if (status) {
-    write_char('\n');
-    write_char('~');
-    write_char('>');
-    write_char('\n');
+    write_eod();
   }
   
-  /* Flush any buffered data */
+  /* Write the end lines of a reusable stream definition, which store
+   * the stream under its name now that the data has been read, and the
+   * use lines, if there are any */
+  if (status && (pPost != NULL)) {
+    write_line(pPost);
+  }
+  
+  /* If a checksum was computed, write it as a comment line after the
+   * end of stream marker so that it is included in the DSC line count,
+   * and optionally also report it on standard error */
+  if (status && (sum_type != SUM_NONE)) {
+    write_sum(flag_sumerr);
+  }
+  
+  /* Close the last segment, which in streaming mode also writes its
+   * closing comment */
   if (status) {
-    write_char(-1);
+    seg_close();
   }
   
-  /* If we are in DSC mode, now we can write the start of data tag */
-  if (status && flag_dsc) {
-    if (printf("%%%%BeginData: %ld ASCII Lines", (long) m_line_count)
-          < 1) {
-      fprintf(stderr, "%s: I/O error writing to standard output!\n",
-        pModule);
-      abort();
-    }
-    line_break();
+  /* Flush any buffered data */
+  if (status) {
+    write_char(-1);
   }
   
-  /* If we are in DSC mode, rewind the temporary file and transfer
-   * everything to standard output */
-  if (status && flag_dsc) {
+  /* If we are in DSC mode and not streaming, rewind the temporary file
+   * and transfer each segment to standard output, wrapped in start and
+   * end of data tags now that its line count is known */
+  if (status && flag_dsc && (!flag_stream)) {
+    /* All the output is now in the temporary file */
+    PSDATA_PROBE(spool_end, m_data_count);
+    
     /* Rewind the temporary file */
     if (fseek(pTemp, 0, SEEK_SET)) {
       fprintf(stderr, "%s: Failed to rewind temporary file!\n",
@@ -847,61 +5132,110 @@ int main(int argc, char *argv[]) {
     }
     memset(pbuf, 0, TRANS_BUF);
     
-    /* Keep transferring while data remains */
-    while (tcount < m_data_count) {
+    for(si = 0; si < m_seg_count; si++) {
+      /* Write the start of data tag, and remember how much output now
+       * precedes the data of this segment */
+      m_seg_extra_off += dsc_begin(m_seg[si].lines);
+      m_seg_extra_line++;
+      m_seg[si].shift_off = m_seg_extra_off;
+      m_seg[si].shift_line = m_seg_extra_line;
       
-      /* Current transfer length is the minimum of the total number of
-       * bytes remaining to be transferred, and the size of the transfer
-       * buffer */
-      tlen = m_data_count - tcount;
-      if (tlen > TRANS_BUF) {
-        tlen = TRANS_BUF;
-      }
+      /* Keep transferring while data remains in this segment */
+      tend = tcount + m_seg[si].bytes;
+      while (tcount < tend) {
+        
+        /* Current transfer length is the minimum of the total number
+         * of bytes remaining to be transferred, and the size of the
+         * transfer buffer */
+        if (tend - tcount > TRANS_BUF) {
+          tlen = TRANS_BUF;
+        } else {
+          tlen = (int32_t) (tend - tcount);
+        }
+        
+        /* Read bytes into the transfer buffer */
+        if (fread(pbuf, 1, (size_t) tlen, pTemp) != (size_t) tlen) {
+          fprintf(stderr, "%s: I/O error reading from temporary file!\n",
+            pModule);
+          abort();
+        }
+        
+        /* Write the transfer buffer to standard output */
+        if (fwrite(pbuf, 1, (size_t) tlen, stdout) != (size_t) tlen) {
+          fprintf(stderr, "%s: I/O error transferring to output!\n",
+            pModule);
+          abort();
+        }
       
-      /* Read bytes into the transfer buffer */
-      if (fread(pbuf, 1, (size_t) tlen, pTemp) != tlen) {
-        fprintf(stderr, "%s: I/O error reading from temporary file!\n",
-          pModule);
-        abort();
+        /* Increase the transfer count */
+        tcount += tlen;
+        PSDATA_PROBE(transfer, tlen);
       }
       
-      /* Write the transfer buffer to standard output */
-      if (fwrite(pbuf, 1, (size_t) tlen, stdout) != tlen) {
-        fprintf(stderr, "%s: I/O error transferring to output!\n",
-          pModule);
-        abort();
-      }
-    
-      /* Increase the transfer count */
-      tcount += tlen;
+      /* Write the closing comment */
+      m_seg_extra_off += dsc_end();
+      m_seg_extra_line++;
     }
   }
   
-  /* If we are in DSC mode, finish by writing the closing comment */
-  if (status && flag_dsc) {
-    if (printf("%%%%EndData") < 1) {
-      fprintf(stderr, "%s: I/O error writing to standard output!\n",
+  /* In deduplication mode, record the payload that was just defined */
+  if (status && (pDedup != NULL)) {
+    if (!dedup_record(pDedup, dedup_hex, dedup_name)) {
+      status = 0;
+      fprintf(stderr, "%s: Failed to update deduplication state file!\n",
+        pModule);
+    }
+  }
+  
+  /* If we are writing an index, complete it now that the amount of
+   * output preceding each segment is known */
+  if (status && (m_index != NULL)) {
+    if (!index_finish()) {
+      status = 0;
+      fprintf(stderr, "%s: I/O error writing to index file!\n",
         pModule);
-      abort();
     }
-    line_break();
   }
   
   /* Reset m_out to stdout */
   m_out = stdout;
   
+  /* Close the index file if open */
+  if (m_index != NULL) {
+    if (fclose(m_index)) {
+      if (status) {
+        status = 0;
+        fprintf(stderr, "%s: I/O error writing to index file!\n",
+          pModule);
+      }
+    }
+    m_index = NULL;
+  }
+  
   /* Close the temporary file if open */
   if (pTemp != NULL) {
     fclose(pTemp);
     pTemp = NULL;
   }
   
+  /* Close the input spool if open */
+  if (pSpool != NULL) {
+    fclose(pSpool);
+    pSpool = NULL;
+  }
+  
   /* Free buffer if allocated */
   if (pbuf != NULL) {
     free(pbuf);
     pbuf = NULL;
   }
   
+  /* Free the segment table if allocated */
+  if (m_seg != NULL) {
+    free(m_seg);
+    m_seg = NULL;
+  }
+  
   /* Invert status and return */
   if (status) {
     status = 0;